@@ -3,13 +3,18 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <ucontext.h>
 #include <time.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -18,16 +23,49 @@
 #include "util.h"
 #include "bios.h"
 
+/* Older glibc does not name the thread id of a SIGEV_THREAD_ID event */
+#if !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- One POSIX timer per core thread, which sends SIGALRM directly to
+	  the core thread (SIGEV_THREAD_ID); the handler raises ALARM.
+	- Core threads mask all signals except for USR1 and ALRM.
+	- The PIC thread receives all other signals, and dispatches device
+	interrupts to the right core thread by raising SIGUSR1.
+	- The PIC thread waits on an epoll set, where each device and
+	  signalfd is registered once.
+
+	Interrupt flag:
+	- SIGUSR1 is never masked on a core thread, except in cpu_core_halt().
+	  Instead, each core has a software interrupt-enable flag, so that
+	  disabling and enabling interrupts does not take a system call.
+	- If SIGUSR1 or SIGALRM arrives while the flag is clear, or while the
+	  flag is being updated, the handler just returns, leaving the interrupt
+	  pending; cpu_enable_interrupts() dispatches the pending interrupts.
+	- The handler runs with SA_NODEFER, and clears the flag while it
+	  dispatches, as the hardware would. A handler may switch contexts;
+	  the new context must not run with SIGUSR1 masked.
+
+	Halting:
+	- By default, a halted core waits for SIGUSR1 or SIGALRM in sigwaitinfo().
+	- If the VM is configured with halt_futex, a halted core waits on a
+	  futex in its Core instead, and an interrupt for a halted core wakes
+	  the futex. Signals are only sent to running cores.
+
+	Virtual time:
+	- If the VM is configured with virtual_time, bios_clock() returns the 
+	  host's monotonic time plus a skew. 
+	- Each core records the (virtual) time its timer is due.
+	- When the last core halts, and no interrupts are pending, the skew 
+	  is increased so that the clock jumps to the earliest due timer, 
+	  and that timer is fired at once. So, idle time takes no time.
 
  */
 
@@ -48,8 +86,11 @@ typedef struct core
 
 	struct sigevent timer_sigevent;
 	timer_t timer_id;
+	volatile TimerDuration timer_due;	/* Virtual time of the timer, or 0 */
 
 	volatile uint32_t intr_pending;
+	volatile sig_atomic_t intr_enabled;	/* The interrupt flag */
+	uint32_t halted;					/* Futex word: the core waits on it */
 	interrupt_handler* intvec[maximum_interrupt_no];
 
 
@@ -73,8 +114,8 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
+/* The signals a halted core waits for: SIGUSR1 and SIGALRM */
+static sigset_t halt_signal_set;
 
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
@@ -103,11 +144,18 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
+/* Save the sigaction for SIGALRM */
+static struct sigaction ALRM_saved_sigaction;
+
+/* The sigaction for SIGALRM (core timers) */
+static struct sigaction ALRM_sigaction;
+
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300000
 
-/* Forward decl. of per-core signal handler */
+/* Forward decl. of per-core signal handlers */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
+static void sigalrm_handler(int signo, siginfo_t* si, void* ctx);
 
 /* PIC daemon statistics */
 static unsigned long PIC_loops;
@@ -115,6 +163,18 @@ static unsigned long PIC_loops;
 /* Physical cores (needed for some heuristics) */
 static unsigned int physical_cores;
 
+/* The VM runs in virtual time */
+static int virtual_time;
+
+/* Halted cores wait on a futex */
+static int halt_futex;
+
+/* The idle time skipped in virtual time */
+static TimerDuration virtual_skew;
+
+/* Serializes clock jumps */
+static pthread_mutex_t virtual_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 /* Initialize static vars. This is called via pthread_once() */
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
@@ -123,20 +183,26 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
-	/* Create the sigmask to block all signals, except USR1 */
+	ALRM_sigaction.sa_sigaction = sigalrm_handler;
+	ALRM_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(& ALRM_sigaction.sa_mask);
+
+	/* Create the sigmask to block all signals, except USR1 and ALRM */
 	CHECK(sigfillset(&core_signal_set));
 	CHECK(sigdelset(&core_signal_set, SIGUSR1));
+	CHECK(sigdelset(&core_signal_set, SIGALRM));
 
 	/* Create the mask for blocking SIGUSR1 */
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
+	/* Create the mask for halting */
+	CHECK(sigemptyset(&halt_signal_set));
+	CHECK(sigaddset(&halt_signal_set, SIGUSR1));
+	CHECK(sigaddset(&halt_signal_set, SIGALRM));
 
 
 	/* Create signaldf_set */
@@ -158,8 +224,7 @@ static inline Core* curr_core() {
 
 
 /*
-	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	Cause PIC daemon to loop. This is used to stop it.
  */
 static inline void interrupt_pic_thread()
 {
@@ -178,8 +243,10 @@ static void* core_thread(void* _core)
 {
 	Core* core = (Core*)_core;
 
-	/* Clear pending bitvec */
+	/* Clear pending bitvec; interrupts start enabled */
 	core->intr_pending = 0;
+	core->intr_enabled = 1;
+	core->halted = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -188,10 +255,11 @@ static void* core_thread(void* _core)
 	cpu_core_id = core->id;
 
 	/* Set core signal mask */
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
+	/* create a thread-specific timer, which signals this thread */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_notify_thread_id = syscall(SYS_gettid);
 	core->timer_sigevent.sigev_signo = SIGALRM;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
 	// Could also be CLOCK_REALTIME
@@ -232,7 +300,8 @@ static void* core_thread(void* _core)
 static inline int intr_fetch_set(Core* core, Interrupt intno)
 {
 	uint32_t sel = 1<<intno;
-	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_ACQ_REL);
+	/* This is paired with the check of the halted core (see cpu_core_halt) */
+	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_SEQ_CST);
 	return (old & sel) != 0;
 }
 
@@ -273,13 +342,30 @@ static inline int intr_fetch_lowest(Core* core, Interrupt* intp)
 }
 
 
+static inline void futex_wait(uint32_t* addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t* addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /* 
 	Cause the given core to be interrupted in the future.
 	This function does not add a pending interrupt, but
-	causes a signal to be sent to the core.
+	causes a signal to be sent to the core, or wakes the core
+	if it is halted on its futex.
  */
 static inline void interrupt_core(Core* core)
 {
+	if(halt_futex && __atomic_load_n(& core->halted, __ATOMIC_SEQ_CST)) {
+		if(__atomic_exchange_n(& core->halted, 0, __ATOMIC_SEQ_CST))
+			futex_wake(& core->halted);
+		return;
+	}
+
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;	
@@ -342,10 +428,120 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	The interrupt flag.
+
+	The flag is per core, but the thread that updates it may be switched
+	by a handler to another core, in the middle of the update (handlers
+	run with the signal unmasked, and may yield). Therefore, the flag is
+	only updated by the two functions below, which the linker places in
+	their own section. A signal that interrupts one of them leaves its
+	interrupt pending: intr_flag_clear() then returns with the flag off,
+	and cpu_enable_interrupts() checks for pending interrupts after
+	intr_flag_set().
+
+	Where the interrupted PC cannot be read from the signal context, the
+	core signals are blocked during the update instead, at the cost of 
+	two system calls.
+ */
+#if defined(__x86_64__) || defined(__aarch64__)
+#define INTR_FLAG_PC
+#endif
+
+#if defined(INTR_FLAG_PC)
+
+#define INTR_FLAG_TEXT __attribute__((noinline, section("intr_flag_text")))
+extern const char __start_intr_flag_text[], __stop_intr_flag_text[];
+
+#define INTR_FLAG_BEGIN
+#define INTR_FLAG_END
+
+#else
+
+#define INTR_FLAG_TEXT __attribute__((noinline))
+
+#define INTR_FLAG_BEGIN  sigset_t oldmask; \
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &halt_signal_set, &oldmask));
+#define INTR_FLAG_END  \
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &oldmask, NULL));
+
+#endif
+
+static INTR_FLAG_TEXT int intr_flag_clear()
+{
+	INTR_FLAG_BEGIN
+	Core* core = curr_core();
+	int enabled = core->intr_enabled;
+	core->intr_enabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	INTR_FLAG_END
+	return enabled;
+}
+
+static INTR_FLAG_TEXT void intr_flag_set()
+{
+	INTR_FLAG_BEGIN
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	curr_core()->intr_enabled = 1;
+	INTR_FLAG_END
+}
+
+/* Return true if a signal handler interrupted the update of the flag */
+static inline int intr_flag_interrupted(void* ctx)
+{
+#if defined(INTR_FLAG_PC)
+	mcontext_t* mc = & ((ucontext_t*) ctx)->uc_mcontext;
+#if defined(__x86_64__)
+	uintptr_t pc = mc->gregs[REG_RIP];
+#else
+	uintptr_t pc = mc->pc;
+#endif
+	return (uintptr_t) __start_intr_flag_text <= pc 
+		&& pc < (uintptr_t) __stop_intr_flag_text;
+#else
+	/* The update runs with the core signals blocked */
+	return 0;
+#endif
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
+	If interrupts are disabled, they are left pending.
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
+{
+#if defined(CORE_STATISTICS)
+	CORE[si->si_value.sival_int].irq_count++;
+#endif
+
+	if(intr_flag_interrupted(ctx)) return;
+	if(! intr_flag_clear()) return;
+	dispatch_interrupts(curr_core());
+	cpu_enable_interrupts();
+}
+
+
+/*
+	Raise ALARM at the current core, because its timer expired.
+	This does not signal the core; if it is halted on its futex, it
+	stops halting.
+ */
+static inline void core_timer_expired(Core* core)
+{
+	core->timer_due = 0;
+	intr_fetch_set(core, ALARM);
+	__atomic_store_n(& core->halted, 0, __ATOMIC_SEQ_CST);
+#if defined(CORE_STATISTICS)
+	core->irq_raised[ALARM] ++;
+#endif
+}
+
+
+/*
+	This is the signal handler for the core timers.
+ */
+static void sigalrm_handler(int signo, siginfo_t* si, void* ctx)
 {
 	Core* core = & CORE[si->si_value.sival_int];
 
@@ -353,7 +549,11 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
-	dispatch_interrupts(core);
+	core_timer_expired(core);
+	if(intr_flag_interrupted(ctx)) return;
+	if(! intr_flag_clear()) return;
+	dispatch_interrupts(curr_core());
+	cpu_enable_interrupts();
 }
 
 
@@ -370,6 +570,16 @@ static TimerDuration get_coarse_time()
 	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
 }
 
+/* Virtual clock: the host's monotonic clock (as used by the core timers), 
+   plus the skipped idle time */
+static TimerDuration get_virtual_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull
+		+ __atomic_load_n(&virtual_skew, __ATOMIC_ACQUIRE);
+}
+
 
 
 /*
@@ -393,6 +603,11 @@ static TimerDuration get_coarse_time()
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
 	When a not-ready device becomes ready, an interrupt is raised.
+
+	A transfer moves as many bytes as the fd accepts in one syscall. An RX
+	device also reads ahead into a small staging buffer, so that byte-at-a-time
+	transfers (bios_read_serial) do not cost a syscall each. The device is only
+	made not-ready when the staging buffer is empty and the fd has no data.
  */
 
 typedef enum io_direction
@@ -406,6 +621,8 @@ typedef enum io_direction
 /*
 	An io_device is a file descriptor from which we either read or write bytes.
  */
+#define IO_STAGE_SIZE 4096
+
 typedef struct io_device
 {
 	int fd;              		/* file descriptor */
@@ -414,6 +631,11 @@ typedef struct io_device
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
+
+	/* RX staging buffer, holding bytes stage[head..tail) */
+	int stage_lock;
+	unsigned int stage_head, stage_tail;
+	char stage[IO_STAGE_SIZE];
 } io_device;
 
 
@@ -430,24 +652,6 @@ static int io_device_ready(int fd, io_direction dir) {
 }
 
 
-/*
-	Check that the a device is connected and in a good state.
- */
-static int io_device_check(io_device* dev)
-{
-	struct pollfd fds = { .fd=dev->fd, .events=POLLIN };
-	int rc;
-	do {
-		rc=poll(&fds, 1, 0);
-	} while( rc == -1 && errno==EINTR );
-	CHECK(rc);
-	rc = (fds.revents & (POLLHUP|POLLERR))==0;
-	assert(rc);
-	return rc;
-}
-
-
-
 /*
 	Initialize device
  */
@@ -458,6 +662,8 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 	this->int_core = &CORE[0];
 	this->ready = io_device_ready(fd, iodir);
 	this->last_int = get_coarse_time();
+	this->stage_lock = 0;
+	this->stage_head = this->stage_tail = 0;
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
@@ -475,42 +681,89 @@ static int io_device_destroy(io_device* this)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/* Fill the staging buffer of an RX device with one read. */
+static int io_device_fill(io_device* this, char* buf, unsigned int size)
 {
-	assert(this->iodir == IODIR_RX);
 	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
+	while((rc=read(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
+	int ok = rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
 	if(!ok) perror("io_device_read:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
+	/* The PIC will be told by epoll when the device is ready again */
+	if(rc<=0) {
+		if(this->ready) this->ready = 0;
+		return 0;
 	}
-	return rc==1;
+	return rc;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Read up to size bytes, first from the staging buffer and then with
+	at most one read() from the fd. Large requests are read directly into
+	the caller's buffer; small ones go through the staging buffer.
+
+	The staging buffer is protected by a spinlock, taken with interrupts
+	off, since interrupt handlers may also read from the device.
+ */
+static int io_device_read_block(io_device* this, char* buf, unsigned int size)
+{
+	assert(this->iodir == IODIR_RX);
+
+	int intr = cpu_disable_interrupts();
+	while(__atomic_exchange_n(&this->stage_lock, 1, __ATOMIC_ACQUIRE))
+		while(__atomic_load_n(&this->stage_lock, __ATOMIC_RELAXED));
+
+	unsigned int count = 0;
+	while(count < size) {
+		unsigned int avail = this->stage_tail - this->stage_head;
+		if(avail > 0) {
+			unsigned int n = (size-count < avail) ? size-count : avail;
+			memcpy(buf+count, this->stage+this->stage_head, n);
+			this->stage_head += n;
+			count += n;
+		}
+		else if(count == 0) {
+			if(size >= IO_STAGE_SIZE) {
+				count = io_device_fill(this, buf, size);
+				break;
+			}
+			this->stage_head = 0;
+			this->stage_tail = io_device_fill(this, this->stage, IO_STAGE_SIZE);
+			if(this->stage_tail == 0) break;
+		}
+		else
+			break;
+	}
+
+	__atomic_store_n(&this->stage_lock, 0, __ATOMIC_RELEASE);
+	if(intr) cpu_enable_interrupts();
+	return count;
+}
+
+
+/*
+	Write up to size bytes with one write(). A short write means that
+	the fd is full.
+ */
+static int io_device_write_block(io_device* this, const char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
 	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	int ok = rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
 	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
+	if(rc<(int)size && this->ready)
 		this->ready = 0;
-		interrupt_pic_thread();
-	} 
 
-	return rc==1;
+	return (rc>0) ? rc : 0;
 }
 
 
@@ -565,19 +818,25 @@ static int terminal_destroy(terminal* this)
 	Implementation:
 	- Use Linux signal file descriptors to receive signals. Currently,
 	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
-
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
-
-	- Monitor these fds together with the fds of the terminals.
+	  * SIGUSR1 simply wakes up the PIC_daemon thread, so that it 
+	    notices that it must stop.
+
+	  The core timers do not go through the PIC; they signal their core
+	  directly.
+
+	- Monitor these fds together with the fds of the terminals, in an 
+	  epoll set. Each fd is registered once, when the PIC starts. The 
+	  devices are registered edge-triggered: a device that fails a transfer
+	  (and thus becomes not READY) is reported by epoll when it becomes
+	  READY again, so the PIC needs not be told about it. The cost of an
+	  event does not depend on the number of devices.
 	
-	- At each loop dispatch interrupts as needed:
-	  * ALARM interrupts to those cores whose timer has expired
+	- For each event, dispatch interrupts as needed:
 	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
 	    an io_device which is now READY.		
+
+	- Every SERIAL_TIMEOUT, raise the interrupts of the devices that have 
+	  not raised one for that long, in case some interrupt was missed.
  */
 
 
@@ -627,93 +886,62 @@ static void close_signalfd(int sfd)
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
+/* The PIC event set */
+static int pic_epfd;
 
+/* Tag of the signalfd in the event set. Devices are tagged by their io_device. */
+static char pic_wakeup_tag;
 
-static void pic_selector_reset(pic_selector* ps)
-{
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
-}
+/* Max. number of events taken per epoll_wait() */
+#define PIC_EVENTS 64
 
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+static inline void pic_add_fd(int fd, uint32_t events, void* tag)
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	struct epoll_event ev = { .events = events, .data.ptr = tag };
+	CHECK(epoll_ctl(pic_epfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
 
-
-static int pic_select(pic_selector* ps)
+static inline void pic_add_io_device(io_device* dev)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
-	}
-	return selcode;
+	pic_add_fd(dev->fd, ((dev->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT) | EPOLLET, dev);
 }
 
 
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
+static inline void pic_add_terminal(terminal* term)
 {
-	return FD_ISSET(fd, & ps->fds[dir]);
+	pic_add_io_device(& term->kbd);
+	pic_add_io_device(& term->con);
 }
 
 
-
-
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+static void pic_raise_device(io_device* dev, TimerDuration now)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
-}
-
-
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
-{
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
+	dev->ready = 1;
+	dev->last_int = now;
+	Core* core = (Core*) dev->int_core;
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
 }
 
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+static void pic_raise_timeouts(TimerDuration now)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	for(uint i=0; i<nterm; i++) {
+		terminal* term = & TERM[i];
+		if(now - term->con.last_int > SERIAL_TIMEOUT) 
+			pic_raise_device(& term->con, now);
+		if(now - term->kbd.last_int > SERIAL_TIMEOUT) 
+			pic_raise_device(& term->kbd, now);
 	}
 }
 
 
-
-
 static void PIC_daemon(void)
 {
 
@@ -724,65 +952,66 @@ static void PIC_daemon(void)
 
 	/* Open signal queues */
 	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+
+	/* Register everything with the event set */
+	pic_epfd = epoll_create1(0);
+	CHECK(pic_epfd);
+	pic_add_fd(sigusr1fd, EPOLLIN, &pic_wakeup_tag);
+	for(uint i=0; i<nterm; i++)
+		pic_add_terminal(& TERM[i]);
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 	
 	/* The PIC multiplexing loop */
+	TimerDuration last_timeouts = get_coarse_time();
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
-
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
+		struct epoll_event events[PIC_EVENTS];
 
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
+		/* Sleep until the next check for timeouts, at most */
+		TimerDuration since = get_coarse_time() - last_timeouts;
+		int sleep_ms = (since < SERIAL_TIMEOUT) ? (SERIAL_TIMEOUT - since + 999)/1000 : 0;
 
-		if(pic_select(&ps) == -1)
+		int nevents = epoll_wait(pic_epfd, events, PIC_EVENTS, sleep_ms);
+		if(nevents == -1) {
+			/* An error is likely EINTR */
+			if(errno != EINTR)  perror("PIC_daemon: ");
 			continue;
+		}
 
 		PIC_loops++ ;
+		TimerDuration now = get_coarse_time();
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
+		for(int e=0; e<nevents; e++) {
+			void* tag = events[e].data.ptr;
 
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+			if(tag == &pic_wakeup_tag) {
+				drain_signalfd(sigusr1fd);
+			}
+			else {
+				/* A device became ready (or was hung up; the transfer will tell) */
+				pic_raise_device((io_device*) tag, now);
 			}
 		}
 
-
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
-		}
-
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+		if(now - last_timeouts >= SERIAL_TIMEOUT) {
+			pic_raise_timeouts(now);
+			last_timeouts = now;
 		}
-
-
 	}
 
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
+	/* Close the event set and signal fds */
+	CHECK(close(pic_epfd));
 	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -856,6 +1085,10 @@ void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint s
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+	const char* vt = getenv("TINYOS_VIRTUAL_TIME");
+	vmc->virtual_time = (vt != NULL && atoi(vt) != 0);
+	const char* hf = getenv("TINYOS_HALT_FUTEX");
+	vmc->halt_futex = (hf != NULL && atoi(hf) != 0);
 	CHECK(vm_config_terminals(vmc, serialno, 0));
 }
 
@@ -882,6 +1115,7 @@ void vm_run(vm_config* vmc)
 
 	/* Install signal handler for SIGUSR1 */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	CHECK(sigaction(SIGALRM, &ALRM_sigaction, &ALRM_saved_sigaction));
 
 	/* Set pic_active to 1 */
 	PIC_thread = pthread_self();
@@ -902,11 +1136,17 @@ void vm_run(vm_config* vmc)
 	/* Initialize the halted vector */
 	halt_vector = 0;
 
+	/* Initialize the clock */
+	virtual_time = vmc->virtual_time;
+	halt_futex = vmc->halt_futex;
+	virtual_skew = 0;
+
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
 		/* Initialize Core */
 		CORE[c].bootfunc = vmc->bootfunc;
 		CORE[c].id = c;
+		CORE[c].timer_due = 0;
 
 
 #if defined(CORE_STATISTICS)
@@ -958,6 +1198,7 @@ void vm_run(vm_config* vmc)
 
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECK(sigaction(SIGALRM, &ALRM_saved_sigaction, NULL));
 
 
 	/* print statistics */
@@ -994,37 +1235,114 @@ uint cpu_cores()
 
 
 
+/*
+	Called by the last core to halt, in virtual time. If no core has
+	pending interrupts, advance the clock to the earliest due timer, and
+	fire the timers that are due.
+ */
+static void virtual_time_jump()
+{
+	CHECKRC(pthread_mutex_lock(&virtual_mutex));
+
+	TimerDuration due = 0;
+	int busy = 0;
+	for(uint c=0; c<ncores; c++) {
+		if(CORE[c].intr_pending) busy = 1;
+		TimerDuration t = CORE[c].timer_due;
+		if(t != 0 && (due == 0 || t < due)) due = t;
+	}
+
+	/* A core with pending interrupts is about to run */
+	uint32_t allmask = (ncores == 32) ? ~0u : (1u << ncores) - 1;
+	if(busy || due == 0 || __atomic_load_n(&halt_vector, __ATOMIC_ACQUIRE) != allmask)
+		goto done;
+
+	TimerDuration now = get_virtual_time();
+	if(due > now)
+		__atomic_add_fetch(&virtual_skew, due - now, __ATOMIC_RELEASE);
+
+	/* Fire the due timers now, instead of waiting for the host timer.
+	   The other host timers are relative to the host clock, so they are
+	   re-armed against the new virtual clock; else, they would expire 
+	   late by the skipped time. */
+	struct itimerspec zero = { {0, 0}, {0, 0} };
+	now = get_virtual_time();
+	for(uint c=0; c<ncores; c++) {
+		TimerDuration t = CORE[c].timer_due;
+		if(t == 0) continue;
+		if(t <= due) {
+			CORE[c].timer_due = 0;
+			timer_settime(CORE[c].timer_id, 0, &zero, NULL);
+			raise_interrupt(&CORE[c], ALARM);
+		}
+		else {
+			TimerDuration usec = (t > now) ? t - now : 1;
+			struct itimerspec newtime = {
+				.it_value = {.tv_sec = usec / 1000000, .tv_nsec = (usec % 1000000) * 1000},
+				.it_interval = {0, 0}
+			};
+			struct itimerspec oldtime;
+			timer_settime(CORE[c].timer_id, 0, &newtime, &oldtime);
+			/* The timer expired meanwhile; do not fire it twice */
+			if(oldtime.it_value.tv_sec == 0 && oldtime.it_value.tv_nsec == 0)
+				timer_settime(CORE[c].timer_id, 0, &zero, NULL);
+		}
+	}
+
+done:
+	CHECKRC(pthread_mutex_unlock(&virtual_mutex));
+}
+
+
 void cpu_core_halt()
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	/* Interrupts that arrive while halted are left pending. This comes
+	   first, since a handler may switch us to another core. */
+	cpu_disable_interrupts();
 
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
 
+	if(halt_futex)
+		/* Set before the halt bit, so that __core_restart() sees it */
+		__atomic_store_n(& core->halted, 1, __ATOMIC_SEQ_CST);
+	else
+		/* Mask the core signals, in order to wait for them */
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &halt_signal_set, NULL));
+
 #if defined(CORE_STATISTICS)
 	TimerDuration stime0 = get_coarse_time();
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	uint32_t hv = __atomic_or_fetch(& halt_vector, cmask, __ATOMIC_ACQ_REL);
+
+	/* In virtual time, the last core to halt skips the idle time */
+	uint32_t allmask = (ncores == 32) ? ~0u : (1u << ncores) - 1;
+	if(virtual_time && hv == allmask)
+		virtual_time_jump();
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
+	if(halt_futex) {
+		/* Sleep until woken by interrupt_core(), unless an interrupt is
+		   pending. This is paired with intr_fetch_set(). */
+		while(__atomic_load_n(& core->intr_pending, __ATOMIC_SEQ_CST) == 0
+			&& __atomic_load_n(& core->halted, __ATOMIC_SEQ_CST))
+			futex_wait(& core->halted, 1);
+		__atomic_store_n(& core->halted, 0, __ATOMIC_RELAXED);
 	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	else if(__atomic_load_n(& core->intr_pending, __ATOMIC_ACQUIRE) == 0) {
+		/* Sleep, unless an interrupt came while interrupts were disabled */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&halt_signal_set, &info, &halt_time);
+		siginfo_t info;
+		int rc = sigwaitinfo(&halt_signal_set, &info);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
+		if(rc == SIGALRM)
+			core_timer_expired(core);
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1034,7 +1352,10 @@ void cpu_core_halt()
 
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	/* Dispatch with the signals unmasked, since a handler may switch contexts */
+	if(! halt_futex)
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &halt_signal_set, NULL));
+	cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
@@ -1079,6 +1400,11 @@ void cpu_core_restart_all()
 		__core_restart(c);
 }
 
+void cpu_core_yield()
+{
+	sched_yield();
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
@@ -1092,32 +1418,38 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return curr_core()->intr_enabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return intr_flag_clear();
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	intr_flag_set();
+
+	/* Dispatch the interrupts that came while disabled. A handler may
+	   switch contexts, and we may come back on another core, so the
+	   core is looked up again each time. */
+	while(__atomic_load_n(& curr_core()->intr_pending, __ATOMIC_ACQUIRE)) {
+		if(! intr_flag_clear()) break;
+		dispatch_interrupts(curr_core());
+		intr_flag_set();
+	}
 }
 
 
+#if defined(CPU_UCONTEXT)
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1461,9 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* The core signal mask: SIGUSR1 must not be masked (see cpu_enable_interrupts) */
+  CHECKRC(pthread_once(&init_control, initialize));
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1473,156 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#else
+
+/*
+	The context switch.
+
+	cpu_context_switch(&oldsp, newsp) pushes the callee-saved registers on
+	the current stack, stores the stack pointer to oldsp, loads newsp as 
+	the stack pointer, pops the callee-saved registers from the new stack 
+	and returns---on the new stack. The caller-saved registers are saved 
+	by the compiler around the call, as for any function call.
+
+	A new context gets a stack which looks as if cpu_context_switch had
+	been called from cpu_context_start, with the function of the context
+	in a callee-saved register. cpu_context_start calls the function, which
+	must never return.
+ */
+void cpu_context_switch(void** oldsp, void* newsp);
+void cpu_context_start();
+
+#if defined(__x86_64__)
+
+/*
+	Frame: [mxcsr, x87 cw] r15 r14 r13 r12 rbx rbp <return address>
+	The function of a new context is in rbx.
+ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl cpu_context_switch\n"
+	".type cpu_context_switch,@function\n"
+	"cpu_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_context_switch,.-cpu_context_switch\n"
+
+	".p2align 4\n"
+	".globl cpu_context_start\n"
+	".type cpu_context_start,@function\n"
+	"cpu_context_start:\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+	".size cpu_context_start,.-cpu_context_start\n"
+);
+
+enum { CTX_FRAME_WORDS = 8, CTX_FRAME_FUNC = 5, CTX_FRAME_RET = 7 };
+
+/* The initial [mxcsr, x87 cw] word: all exceptions masked, round to nearest */
+static void cpu_context_init_frame(uint64_t* frame)
+{
+	frame[0] = 0x1F80 | ((uint64_t)0x037F << 32);
+}
+
+#elif defined(__aarch64__)
+
+/*
+	Frame: x19 ... x28, x29 (fp), x30 (lr), d8 ... d15
+	The function of a new context is in x19.
+ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl cpu_context_switch\n"
+	".type cpu_context_switch,%function\n"
+	"cpu_context_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size cpu_context_switch,.-cpu_context_switch\n"
+
+	".p2align 4\n"
+	".globl cpu_context_start\n"
+	".type cpu_context_start,%function\n"
+	"cpu_context_start:\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	".size cpu_context_start,.-cpu_context_start\n"
+);
+
+enum { CTX_FRAME_WORDS = 20, CTX_FRAME_FUNC = 0, CTX_FRAME_RET = 11 };
+
+static void cpu_context_init_frame(uint64_t* frame) { }
+
+#endif
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes, with a zero word for 
+	   debuggers to stop unwinding at */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*)(top - 16) - CTX_FRAME_WORDS;
+
+	for (int i = 0; i < CTX_FRAME_WORDS + 2; i++) frame[i] = 0;
+	cpu_context_init_frame(frame);
+	frame[CTX_FRAME_FUNC] = (uint64_t)(uintptr_t) ctx_func;
+	frame[CTX_FRAME_RET] = (uint64_t)(uintptr_t) cpu_context_start;
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_context_switch(&oldctx->sp, newctx->sp);
+}
+
+#endif
+
 
 
 /*
@@ -1149,6 +1632,9 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 
 TimerDuration bios_set_timer(TimerDuration usec)
 {
+	if(virtual_time)
+		curr_core()->timer_due = (usec == 0) ? 0 : get_virtual_time() + usec;
+
 	time_t sec = usec / 1000000;
 	long nsec = (usec % 1000000) * 1000ull;
 	
@@ -1173,7 +1659,7 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return get_coarse_time();
+	return virtual_time ? get_virtual_time() : get_coarse_time();
 }	
 
 
@@ -1209,7 +1695,7 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read_block(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -1219,7 +1705,27 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write_block(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Read up to 'size' bytes from serial port 'serial' into 'buf'. Return the
+	number of bytes read.
+ */
+int bios_read_serial_block(uint serial, char* buf, unsigned int size)
+{
+	return io_device_read_block(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Write up to 'size' bytes from 'buf' to serial port 'serial'. Return the
+	number of bytes written.
+ */
+int bios_write_serial_block(uint serial, const char* buf, unsigned int size)
+{
+	return io_device_write_block(& TERM[serial].con, buf, size);
 }
 
 
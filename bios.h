@@ -132,7 +132,7 @@ typedef enum Interrupt
 #define MAX_CORES 32
 
 /** @brief Maximum number of terminals for a virtual machine. */
-#define MAX_TERMINALS 4
+#define MAX_TERMINALS 16
 
 
 
@@ -198,6 +198,37 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief Run the VM in virtual time.
+
+		If non-zero, the clock of the VM (see @c bios_clock()) runs with
+		the host's clock while some core is running, but when all cores 
+		are halted, it jumps straight to the time when the earliest core 
+		timer is due, and this timer expires at once. Timeouts and time 
+		slices are measured in this virtual time. Thus, a VM that mostly 
+		waits for timeouts runs much faster than in real time, while cpu 
+		bound work takes the same (virtual) time as in real time.
+
+		Devices are not simulated in virtual time; while a core waits for
+		a device, its timers may expire early, in real time.
+
+		@c vm_configure() sets this field from the environment variable
+		@c TINYOS_VIRTUAL_TIME (non-zero to enable).
+	 */
+	int virtual_time;
+
+	/** @brief Halted cores wait on a futex.
+
+		If non-zero, a halted core (see @c cpu_core_halt()) waits on a
+		futex, and an interrupt for it just wakes up the futex. Else, it
+		waits for a signal. Either way, a running core is interrupted by
+		a signal. Waking up a futex is much faster than delivering a signal,
+		which cuts the wakeup latency of idle cores.
+
+		@c vm_configure() sets this field from the environment variable
+		@c TINYOS_HALT_FUTEX (non-zero to enable).
+	 */
+	int halt_futex;
 } vm_config;
 
 
@@ -344,7 +375,8 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	The interrupt flag is kept in software, so this call (and 
+	@ref cpu_enable_interrupts) is cheap.
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -378,6 +410,10 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	This function may be called with interrupts disabled, so that the core
+	can check for work and halt atomically: an interrupt that arrives after
+	the check is not lost. Interrupts are enabled when this function returns.
 */
 void cpu_core_halt();
 
@@ -404,12 +440,43 @@ void cpu_core_restart_one();
 */
 void cpu_core_restart_all();
 
+/**
+	@brief Let the host run some other core.
+
+	The cores are threads of the host, and the host may have fewer CPUs 
+	than there are cores. A core that busy-waits for another core should 
+	call this once in a while, so that the other core gets to run.
+*/
+void cpu_core_yield();
+
+
+/*
+	On x86-64 and aarch64, the context switch is implemented in assembly.
+	Elsewhere, or if CPU_UCONTEXT is defined, it uses ucontext(3).
+ */
+#if !defined(CPU_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define CPU_UCONTEXT
+#endif
+
+#if defined(CPU_UCONTEXT)
 
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#else
+
+/**
+	@brief A type for saving CPU context into.
+
+	The callee-saved registers of a suspended context are saved on its own 
+	stack, so the context is just the saved stack pointer.
+*/
+typedef struct cpu_context { void* sp; } cpu_context_t;
+
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -430,6 +497,11 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	Only the registers are switched, not the interrupt flag, which belongs
+	to the core. Therefore, contexts must be switched with interrupts disabled
+	(see @ref cpu_disable_interrupts), and a new context starts with interrupts
+	disabled.
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
@@ -477,6 +549,10 @@ TimerDuration bios_cancel_timer();
 	The value of the clock is 10 times the number of seconds since
 	the epoch. 
 
+	If the VM runs in virtual time (see @c vm_config), the clock
+	skips the time when all cores are halted, and its value is not
+	related to the epoch.
+
 	The resolution of the clock is very low, currently 
 	around 100 msec. Therefore, it is inappropriate for any type of
 	precise timing.
@@ -546,4 +622,45 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into @c buf,
+	and return the number of bytes read. This may be less than @c size, if
+	the terminal has not sent that much data.
+
+	If this operation returns 0, a @c SERIAL_RX_READY interrupt will be raised when
+	data is ready to be received.
+
+	Unlike calling @c bios_read_serial in a loop, this moves as many bytes as
+	are available with a single transfer.
+
+	@param serial the serial device to read from
+	@param buf the buffer in which to store the read bytes
+	@param size the size of @c buf
+	@return the number of bytes read
+	@see bios_read_serial
+ */
+int bios_read_serial_block(uint serial, char* buf, unsigned int size);
+
+
+/**
+	@brief Write a block of bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial, 
+	and return the number of bytes written. This may be less than @c size, if
+	the device cannot accept that much data.
+
+	If this operation returns less than @c size, a @c SERIAL_TX_READY interrupt 
+	will be raised when the device is ready to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the number of bytes in @c buf
+	@return the number of bytes written
+	@see bios_write_serial
+ */
+int bios_write_serial_block(uint serial, const char* buf, unsigned int size);
+
+
 #endif
@@ -6,6 +6,32 @@
 #include "kernel_proc.h"
 #include "kernel_cc.h"
 
+#include <time.h>
+
+#if defined(LOCK_PROFILING) || defined(WCHAN_PROFILING)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+/* 
+	A monotonic clock in nsec, for timing inside the kernel. The resolution
+	of bios_clock() is too low, and in virtual time it jumps over idle time.
+ */
+static inline unsigned long cc_clock()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ul + t.tv_nsec;
+}
+
+/* The profiled variants are defined below */
+#if defined(LOCK_PROFILING)
+#undef Mutex_Lock
+#undef Cond_Wait
+#undef Cond_TimedWait
+#endif
+
 
 /**
 	@file kernel_cc.c
@@ -20,11 +46,11 @@
 
 
 /*
- 	Pre-emption aware mutex.
- 	-------------------------
+ 	Pre-emption aware spinlock.
+ 	---------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	This lock will act as a pure spinlock if preemption is off, and a
+ 	yielding spinlock if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
@@ -32,37 +58,665 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+void Spin_Lock(Spinlock* lock)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+#define SPINLOCK_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
   while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
+    int spin=SPINLOCK_SPINS;
     while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-#if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
-#endif
+      cpu_relax();
       if(spin>0) 
       	spin--; 
       else { 
-      	spin=MUTEX_SPINS; 
+      	spin=SPINLOCK_SPINS; 
       	if(cpu_interrupts_enabled())
       		yield(SCHED_MUTEX); 
       }
     }
   }
-#undef MUTEX_SPINS
+#undef SPINLOCK_SPINS
 }
 
 
-void Mutex_Unlock(Mutex* lock)
+void Spin_Unlock(Spinlock* lock)
 {
   __atomic_clear(lock, __ATOMIC_RELEASE);
+
+  /* A thread of higher priority may have yielded, spinning on this lock */
+  if(sched_preempt_pending() && cpu_interrupts_enabled())
+    yield(SCHED_PREEMPT);
+}
+
+
+/*
+	MCS queue lock.
+	---------------
+
+	The lock has a lock byte, and a queue of waiters whose tail is in the
+	lock word. A locker first tries to set the lock byte. If it fails, it
+	appends the queue node of its core to the queue, by an atomic exchange,
+	and spins on its own node until its predecessor tells it that it is 
+	the head of the queue. Only the head spins on the lock byte; once it 
+	gets the lock, it makes its successor the head.
+
+	Thus, under contention, each core spins on a separate cache line, and 
+	a release touches only the line of the lock. Unlike a pure MCS lock,
+	the lock is not handed over to the next waiter: a release just clears
+	the lock byte. The cores are threads of the host, and the host may have
+	fewer CPUs than the VM has cores; so, a waiter may not be running, and 
+	handing the lock to it would stall all other cores. For the same 
+	reason, a core that spins for long gives its host CPU away.
+
+	The locks are only taken in the non-preemptive domain, so a core waits
+	for at most one lock at a time, and it needs a single queue node.
+ */
+
+#define MCS_SPINS 1000
+
+typedef struct mcs_node {
+	struct mcs_node* next;	/* the next waiter in the queue */
+	int wait;				/* cleared when the node becomes the head */
+} __attribute__((aligned(64))) mcs_node;
+
+static mcs_node mcs_nodes[MAX_CORES];
+
+static inline void mcs_spin(int* spin)
+{
+	cpu_relax();
+	if(--(*spin) == 0) {
+		*spin = MCS_SPINS;
+		cpu_core_yield();
+	}
+}
+
+
+void Mcs_Lock(McsLock* lock)
+{
+	if(! __atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE))
+		return;
+
+	/* Join the queue */
+	mcs_node* node = &mcs_nodes[cpu_core_id];
+	node->next = NULL;
+	node->wait = 1;
+
+	int spin = MCS_SPINS;
+	mcs_node* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(prev != NULL) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while(__atomic_load_n(&node->wait, __ATOMIC_ACQUIRE))
+			mcs_spin(&spin);
+	}
+
+	/* We are the head of the queue */
+	while(__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE))
+		while(__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+			mcs_spin(&spin);
+
+	/* Leave the queue, making the successor the head */
+	mcs_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if(next == NULL) {
+		mcs_node* last = node;
+		if(__atomic_compare_exchange_n(&lock->tail, &last, NULL, 
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+		/* A successor is linking itself behind us */
+		while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+	__atomic_store_n(&next->wait, 0, __ATOMIC_RELEASE);
+}
+
+
+void Mcs_Unlock(McsLock* lock)
+{
+	__atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
+
+
+/*
+	Profile tables.
+	---------------
+
+	The lock profile and the wait channel profile keep their counters in
+	the same kind of table: each core has an open-addressing hash table
+	of entries, keyed by a pair of pointers. An entry starts with a
+	prof_key, followed by the counters of the profile.
+
+	A slot is claimed by a compare-and-swap of its state. A thread may
+	move to another core in the middle of an update, so the counters are
+	updated by relaxed atomics; the table of a core is still mostly
+	private to it. At shutdown, prof_collect() merges the tables of all
+	cores for the report.
+ */
+
+#if defined(LOCK_PROFILING) || defined(WCHAN_PROFILING)
+
+enum { PROF_FREE, PROF_CLAIMED, PROF_USED };
+
+typedef struct prof_key {
+	const void* a;
+	const void* b;
+	int state;
+} prof_key;
+
+#define PROF_ADD(e, field, x) __atomic_add_fetch(&(e)->field, (x), __ATOMIC_RELAXED)
+
+/* Find or add the entry of key (a,b) in a table of the given number of
+   slots (a power of 2), with entries of the given size. If the table is
+   full, return NULL. */
+static prof_key* prof_entry_get(void* table, size_t size, uint slots,
+	const void* a, const void* b)
+{
+	uintptr_t h = ((uintptr_t) a >> 3) * 0x9E3779B1u + ((uintptr_t) b >> 3);
+	h ^= h >> 16;
+
+	for(uint i = 0; i < slots; i++) {
+		prof_key* e = (prof_key*) ((char*) table + ((h + i) & (slots - 1)) * size);
+		int state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+		if(state == PROF_FREE && __atomic_compare_exchange_n(&e->state, &state, PROF_CLAIMED,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			e->a = a;
+			e->b = b;
+			__atomic_store_n(&e->state, PROF_USED, __ATOMIC_RELEASE);
+			return e;
+		}
+		while(state == PROF_CLAIMED)
+			state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+		if(e->a == a && e->b == b)
+			return e;
+	}
+	return NULL;
+}
+
+static int prof_by_key(const void* x, const void* y)
+{
+	const prof_key *p = x, *q = y;
+	if(p->a != q->a) return (p->a < q->a) ? -1 : 1;
+	if(p->b != q->b) return (p->b < q->b) ? -1 : 1;
+	return 0;
+}
+
+/* Collect the entries of the tables of all cores into a malloc'ed array,
+   and clear the tables. Entries with the same key are merged into one,
+   by merge(). Return the array, and its length in *count. */
+static void* prof_collect(void* tables, size_t size, uint slots,
+	void (*merge)(void* into, const void* from), size_t* count)
+{
+	char* all = malloc(size * MAX_CORES * slots);
+	size_t n = 0;
+	for(size_t i = 0; i < (size_t) MAX_CORES * slots; i++) {
+		prof_key* e = (prof_key*) ((char*) tables + i * size);
+		if(e->state == PROF_USED) {
+			memcpy(all + n++ * size, e, size);
+			memset(e, 0, size);
+		}
+	}
+
+	qsort(all, n, size, prof_by_key);
+	size_t m = 0;
+	for(size_t i = 0; i < n; i++) {
+		if(m > 0 && prof_by_key(all + (m-1) * size, all + i * size) == 0)
+			merge(all + (m-1) * size, all + i * size);
+		else
+			memmove(all + m++ * size, all + i * size, size);
+	}
+
+	*count = m;
+	return all;
+}
+
+#endif
+
+/*
+	Lock profiling.
+	---------------
+
+	When LOCK_PROFILING is defined (see the Makefile), the mutex and
+	condition variable operations keep statistics per lock and call site:
+	the number of acquisitions (or waits, for a CondVar), how many of them
+	found the lock taken, the spins and sleeps of these, the total time 
+	spent waiting, and the total time the mutex was held.
+
+	The entries are kept in a profile table (see above), keyed by the
+	lock address and the site. The tables are merged and reported at
+	shutdown, by lock_profile_report().
+
+	When LOCK_PROFILING is not defined, the LOCK_PROF() statements vanish.
+ */
+
+/* The counts of a contended acquisition */
+typedef struct lock_prof_sample {
+	unsigned long start;	/* when waiting started, in nsec */
+	unsigned long spins, sleeps;
+} lock_prof_sample;
+
+#if defined(LOCK_PROFILING)
+
+#define LOCK_PROF(...) __VA_ARGS__
+
+#define LOCK_PROF_SLOTS 1024		/* per core, a power of 2 */
+
+typedef struct lock_prof_entry {
+	prof_key key;		/* the lock and the site */
+	unsigned long acquired, contended, spins, sleeps;
+	unsigned long wait, hold;	/* in nsec */
+} lock_prof_entry;
+
+static lock_prof_entry lock_prof[MAX_CORES][LOCK_PROF_SLOTS];
+
+static inline lock_prof_entry* lock_prof_entry_get(const void* lock, const char* site)
+{
+	return (lock_prof_entry*) prof_entry_get(lock_prof[cpu_core_id], sizeof(lock_prof_entry),
+		LOCK_PROF_SLOTS, lock, site);
+}
+
+/* Account an acquisition of a mutex, or a wait on a condition variable */
+static lock_prof_entry* lock_prof_acquired(const void* lock, const char* site, 
+	lock_prof_sample* ps, unsigned long now)
+{
+	lock_prof_entry* e = lock_prof_entry_get(lock, site);
+	if(e == NULL) return NULL;
+
+	PROF_ADD(e, acquired, 1);
+	if(ps->start != 0) {
+		PROF_ADD(e, contended, 1);
+		PROF_ADD(e, spins, ps->spins);
+		PROF_ADD(e, sleeps, ps->sleeps);
+		PROF_ADD(e, wait, now - ps->start);
+	}
+	return e;
+}
+
+static void mutex_prof_locked(Mutex* mx, const char* site, lock_prof_sample* ps)
+{
+	unsigned long now = cc_clock();
+	mx->prof = lock_prof_acquired(mx, site, ps, now);
+	mx->prof_since = now;
+}
+
+static void mutex_prof_unlocking(Mutex* mx)
+{
+	lock_prof_entry* e = mx->prof;
+	if(e != NULL)
+		PROF_ADD(e, hold, cc_clock() - mx->prof_since);
+}
+
+static void lock_prof_merge(void* into, const void* from)
+{
+	lock_prof_entry* e = into;
+	const lock_prof_entry* f = from;
+	e->acquired += f->acquired;
+	e->contended += f->contended;
+	e->spins += f->spins;
+	e->sleeps += f->sleeps;
+	e->wait += f->wait;
+	e->hold += f->hold;
+}
+
+static int lock_prof_by_wait(const void* a, const void* b)
+{
+	const lock_prof_entry *x = a, *y = b;
+	if(x->wait != y->wait) return (x->wait > y->wait) ? -1 : 1;
+	return (x->contended > y->contended) ? -1 : (x->contended < y->contended);
+}
+
+#define LOCK_PROF_REPORT 40
+
+void lock_profile_report()
+{
+	size_t m;
+	lock_prof_entry* all = prof_collect(lock_prof, sizeof(lock_prof_entry), LOCK_PROF_SLOTS,
+		lock_prof_merge, &m);
+	qsort(all, m, sizeof(lock_prof_entry), lock_prof_by_wait);
+
+	fprintf(stderr, "Lock profile: %zu locks and sites, by wait time\n", m);
+	fprintf(stderr, "%-16s %-24s %10s %10s %10s %8s %12s %12s\n", "lock", "site", 
+		"acquired", "contended", "spins", "sleeps", "wait (ms)", "hold (ms)");
+	for(size_t i = 0; i < m && i < LOCK_PROF_REPORT; i++) {
+		lock_prof_entry* e = &all[i];
+		fprintf(stderr, "%-16p %-24.24s %10lu %10lu %10lu %8lu %12.3f %12.3f\n", 
+			e->key.a, (const char*) e->key.b, e->acquired, e->contended, e->spins, e->sleeps,
+			e->wait * 1E-6, e->hold * 1E-6);
+	}
+
+	free(all);
+}
+
+#else
+
+#define LOCK_PROF(...)
+
+#endif
+
+
+/*
+	Wait channels.
+	--------------
+
+	A thread that blocks records in its TCB the wait channel it sleeps
+	on: the name of the function that called kernel_wait() (or another 
+	wait of a condition variable), "Mutex_Lock" when it sleeps on a
+	mutex, or "sys_WaitOnAddress".
+
+	When WCHAN_PROFILING is defined (see the Makefile), the number of 
+	sleeps on each wait channel, and the total and maximum time blocked
+	on it, are also kept, in a profile table keyed by the wait channel.
+	The tables are merged and reported at shutdown, by
+	wchan_profile_report(). The time is measured by the host's monotonic
+	clock, even if the VM runs in virtual time.
+ */
+
+#if defined(WCHAN_PROFILING)
+
+#define WCHAN_SLOTS 128		/* per core, a power of 2 */
+
+typedef struct wchan_entry {
+	prof_key key;		/* the wait channel */
+	unsigned long count;
+	unsigned long total, max;	/* in nsec */
+} wchan_entry;
+
+static wchan_entry wchan_prof[MAX_CORES][WCHAN_SLOTS];
+
+static inline wchan_entry* wchan_entry_get(const char* wchan)
+{
+	return (wchan_entry*) prof_entry_get(wchan_prof[cpu_core_id], sizeof(wchan_entry),
+		WCHAN_SLOTS, wchan, NULL);
+}
+
+static void wchan_account(const char* wchan, unsigned long blocked)
+{
+	wchan_entry* e = wchan_entry_get(wchan);
+	if(e == NULL) return;
+
+	PROF_ADD(e, count, 1);
+	PROF_ADD(e, total, blocked);
+	unsigned long max = __atomic_load_n(&e->max, __ATOMIC_RELAXED);
+	while(blocked > max && !__atomic_compare_exchange_n(&e->max, &max, blocked,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void wchan_merge(void* into, const void* from)
+{
+	wchan_entry* e = into;
+	const wchan_entry* f = from;
+	e->count += f->count;
+	e->total += f->total;
+	if(f->max > e->max) e->max = f->max;
+}
+
+static int wchan_by_total(const void* a, const void* b)
+{
+	const wchan_entry *x = a, *y = b;
+	return (x->total > y->total) ? -1 : (x->total < y->total);
+}
+
+void wchan_profile_report()
+{
+	size_t m;
+	wchan_entry* all = prof_collect(wchan_prof, sizeof(wchan_entry), WCHAN_SLOTS,
+		wchan_merge, &m);
+	qsort(all, m, sizeof(wchan_entry), wchan_by_total);
+
+	fprintf(stderr, "Blocked time: %zu wait channels, by total time\n", m);
+	fprintf(stderr, "%-28s %10s %12s %12s %12s\n", "wchan", 
+		"count", "total (ms)", "avg (us)", "max (ms)");
+	for(size_t i = 0; i < m; i++) {
+		wchan_entry* e = &all[i];
+		fprintf(stderr, "%-28.28s %10lu %12.3f %12.1f %12.3f\n", (const char*) e->key.a, e->count,
+			e->total * 1E-6, e->total * 1E-3 / e->count, e->max * 1E-6);
+	}
+
+	free(all);
+}
+
+#define WCHAN_PROF(...) __VA_ARGS__
+
+#else
+
+#define WCHAN_PROF(...)
+
+#endif
+
+/* Record the wait channel of a thread that is about to sleep */
+static inline void wchan_enter(TCB* tcb, const char* wchan)
+{
+	tcb->wchan = wchan;
+	WCHAN_PROF(tcb->wchan_since = cc_clock());
+}
+
+/* Clear the wait channel of a thread that woke up */
+static inline void wchan_leave(TCB* tcb)
+{
+	WCHAN_PROF(wchan_account(tcb->wchan, cc_clock() - tcb->wchan_since));
+	tcb->wchan = NULL;
+}
+
+
+/*
+ 	Adaptive mutex.
+ 	---------------
+
+ 	The owner word holds the TCB of the owner, or 0 if the mutex is free.
+ 	Bit 0 of the owner word (MUTEX_WAITERS) is set when the wait queue is
+ 	not empty; it is only cleared with waitq_lock held. A free mutex with
+ 	waiters has owner word MUTEX_WAITERS.
+
+ 	Locking and unlocking a free mutex without waiters is a single
+ 	compare-and-swap. A locker that finds the mutex taken spins as long
+ 	as the owner is running (on another core), for a bounded number of
+ 	spins. Then, it joins the wait queue and sleeps.
+
+ 	Unlocking a mutex with waiters wakes up the first waiter. Normally, the
+ 	mutex is released and the waiter competes for it with new lockers; if
+ 	it loses, it goes back to the front of the queue. This keeps the mutex
+ 	busy while the waiter is being scheduled, and avoids lock convoys. But
+ 	once the first waiter has waited for more than MUTEX_HANDOFF_WAIT, the
+ 	mutex is handed over to it: the owner word is set to the waiter's TCB
+ 	before it is woken up. So, no waiter starves.
+
+ 	Since TCBs are never unmapped, reading the state of a stale owner
+ 	is harmless; it only affects the decision to spin.
+ */
+
+#define MUTEX_WAITERS ((uintptr_t) 1)
+#define MUTEX_SPINS 1000
+#define MUTEX_HANDOFF_WAIT 1000000ul	/* nsec */
+
+/** \cond HELPER Helper structure for mutex waiters. */
+typedef struct __mx_waiter {
+	rlnode node;		/* become part of the wait queue */
+	TCB* thread;		/* thread to wait */
+	unsigned long since;	/* the time it started waiting, by cc_clock() */
+	int handoff;		/* set if the mutex was handed over */
+} __mx_waiter;
+/** \endcond */
+
+
+static inline TCB* mutex_self()
+{
+	TCB* self = cur_thread();
+
+	/* During boot, before the scheduler runs, the idle thread of the core
+	   stands for the caller */
+	return (self != NULL) ? self : &cctx[cpu_core_id].idle_thread;
+}
+
+
+/* A caller that has already waited in the queue since 'since' (if not 0)
+   goes back to the front of the queue */
+static void mutex_lock_slow(Mutex* mx, TCB* self, lock_prof_sample* ps, unsigned long since)
+{
+	int spin = (cpu_cores() > 1) ? MUTEX_SPINS : 0;
+	LOCK_PROF(ps->start = cc_clock());
+	__mx_waiter waiter = { .thread = self, .since = since, .handoff = 0 };
+
+	while(1) {
+		uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+
+		/* A free mutex is taken, keeping the waiters bit */
+		if((owner & ~MUTEX_WAITERS) == 0) {
+			if(__atomic_compare_exchange_n(&mx->owner, &owner, (uintptr_t) self | owner, 
+					0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		/* Spin while the owner is running, unless there are waiters; they
+		   will get the mutex first */
+		TCB* holder = (TCB*) (owner & ~MUTEX_WAITERS);
+		if(spin > 0 && !(owner & MUTEX_WAITERS) 
+				&& __atomic_load_n(&holder->state, __ATOMIC_RELAXED) == RUNNING) {
+			spin--;
+			LOCK_PROF(ps->spins++);
+			cpu_relax();
+			continue;
+		}
+
+		/* Join the wait queue */
+		int preempt = preempt_off;
+		Mcs_Lock(&mx->waitq_lock);
+
+		/* Announce the waiter. If the mutex was released meanwhile, retry. */
+		owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+		if((owner & ~MUTEX_WAITERS) == 0 || (!(owner & MUTEX_WAITERS) && 
+			!__atomic_compare_exchange_n(&mx->owner, &owner, owner | MUTEX_WAITERS,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+			Mcs_Unlock(&mx->waitq_lock);
+			if(preempt) preempt_on;
+			continue;
+		}
+
+		/* A new waiter goes to the back of the queue, a waiter that lost
+		   the mutex after a wakeup goes back to the front */
+		rlnode_init(&waiter.node, &waiter);
+		if(mx->waitq == NULL)
+			mx->waitq = &waiter;
+		else {
+			rlist_push_back(& ((__mx_waiter*) mx->waitq)->node, &waiter.node);
+			if(waiter.since != 0)
+				mx->waitq = &waiter;
+		}
+		if(waiter.since == 0)
+			waiter.since = cc_clock();
+
+		/* Sleep until woken up by an unlocker */
+		LOCK_PROF(ps->sleeps++);
+		wchan_enter(self, "Mutex_Lock");
+		sleep_releasing(STOPPED, &mx->waitq_lock, SCHED_MUTEX, NO_TIMEOUT);
+		wchan_leave(self);
+		if(preempt) preempt_on;
+
+		if(waiter.handoff) {
+			assert((__atomic_load_n(&mx->owner, __ATOMIC_ACQUIRE) & ~MUTEX_WAITERS) == (uintptr_t) self);
+			return;
+		}
+	}
+}
+
+
+static inline void mutex_lock_since(Mutex* mx, const char* site, unsigned long since)
+{
+	TCB* self = mutex_self();
+	uintptr_t owner = 0;
+	lock_prof_sample ps = { 0, 0, 0 };
+
+	if(! __atomic_compare_exchange_n(&mx->owner, &owner, (uintptr_t) self, 
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		mutex_lock_slow(mx, self, &ps, since);
+
+	LOCK_PROF(mutex_prof_locked(mx, site, &ps));
+}
+
+static inline void mutex_lock(Mutex* mx, const char* site)
+{
+	mutex_lock_since(mx, site, 0);
+}
+
+
+void Mutex_Lock(Mutex* mx)
+{
+	mutex_lock(mx, __FUNCTION__);
+}
+
+#if defined(LOCK_PROFILING)
+void Mutex_Lock_at(Mutex* mx, const char* site)
+{
+	mutex_lock(mx, site);
+}
+#endif
+
+
+/* Release a mutex with waiters. If 'wake' is not set, the first waiter
+   is returned, and the caller must wake it up. */
+static TCB* mutex_unlock_slow(Mutex* mx, int wake)
+{
+	int preempt = preempt_off;
+	Mcs_Lock(&mx->waitq_lock);
+
+	/* Pop the first waiter */
+	__mx_waiter* waiter = mx->waitq;
+	assert(waiter != NULL);
+	__mx_waiter* next = waiter->node.next->obj;
+	mx->waitq = (next == waiter) ? NULL : next;
+	rlist_remove(&waiter->node);
+
+	/* Release the mutex, or hand it over to a waiter that waited too long. 
+	   The waiter's node lives on its stack, so it must not be touched 
+	   after the wakeup. */
+	TCB* thread = waiter->thread;
+	uintptr_t waiters = mx->waitq ? MUTEX_WAITERS : 0;
+	if(cc_clock() - waiter->since >= MUTEX_HANDOFF_WAIT) {
+		waiter->handoff = 1;
+		__atomic_store_n(&mx->owner, (uintptr_t) thread | waiters, __ATOMIC_RELEASE);
+	} else
+		__atomic_store_n(&mx->owner, waiters, __ATOMIC_RELEASE);
+
+	Mcs_Unlock(&mx->waitq_lock);
+	if(wake) {
+		wakeup_here(thread);
+		thread = NULL;
+	}
+
+	if(preempt) preempt_on;
+	return thread;
+}
+
+
+/* Unlock a mutex, returning the waiter to wake up (if wake is not set) */
+static inline TCB* mutex_unlock(Mutex* mx, int wake)
+{
+	LOCK_PROF(mutex_prof_unlocking(mx));
+
+	uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+
+	if((owner & MUTEX_WAITERS) || 
+		! __atomic_compare_exchange_n(&mx->owner, &owner, 0, 
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return mutex_unlock_slow(mx, wake);
+	return NULL;
+}
+
+
+void Mutex_Unlock(Mutex* mx)
+{
+	mutex_unlock(mx, 1);
 }
 
 
 /*
 	Condition variables.	
+
+	Cond_Broadcast() does not wake up the waiters that would just go back 
+	to sleep on their mutex, if it is locked. Instead, it moves them to
+	the wait queue of the mutex (wait morphing), as if they had tried to
+	lock it; each of them is woken up by Mutex_Unlock in turn. This is 
+	only done for waiters without a timeout, since a waiter must not time
+	out while it is in the queue of a mutex. The other waiters are woken 
+	up in batches, taking the scheduler lock once per batch.
 */
 
 
@@ -70,9 +724,13 @@ void Mutex_Unlock(Mutex* lock)
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
+	Mutex* mutex;				/* the mutex to re-lock, if it can be morphed */
+	__mx_waiter mx_waiter;		/* used when moved to the queue of the mutex */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t morphed;		/* this is set if the waiter was moved to
+								   the queue of the mutex */
 } __cv_waiter;
 /** \endcond */
 
@@ -99,32 +757,38 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
 	system calls, as well as internal kernel 'wait' functionality.
 
-  The function must be called only while we have locked the mutex that 
-  is associated with this call. It will put the calling thread to sleep, 
-  unlocking the mutex. These operations happen atomically.  
+  The function must be called only while we have locked the mutex (or the
+  spinlock, in the kernel) that is associated with this call. Exactly one of 
+  the two must be given. It will put the calling thread to sleep, 
+  unlocking the lock. These operations happen atomically.  
 
   When the thread is woken up later (by another thread that calls @c 
   Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
   because the thread was awoken by another kernel routine), 
-  it first re-locks the mutex and then returns.  
+  it first re-locks the lock and then returns.  
 
-  @param mx The mutex to be unlocked as the thread sleeps.
+  @param mutex The mutex to be unlocked as the thread sleeps, or NULL.
+  @param spinlock The spinlock to be unlocked as the thread sleeps, or NULL.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+  @param site The call site, for the lock profiler.
 
   @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
 
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
-		enum SCHED_CAUSE cause, TimerDuration timeout)
+static int cv_wait(Mutex* mutex, Spinlock* spinlock, CondVar* cv, 
+		enum SCHED_CAUSE cause, TimerDuration timeout, const char* site)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), 
+		.mutex = (timeout == NO_TIMEOUT) ? mutex : NULL, 
+		.signalled = 0, .removed=0, .morphed = 0 };
 	rlnode_init(& waiter.node, &waiter);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	int preempt = preempt_off;
+	Mcs_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -133,21 +797,42 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		cv->waitset = &waiter;
 	}
 
-	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+	/* Now atomically release the lock and sleep. A waiter of the mutex
+	   is woken up as we block. */
+	TCB* next = NULL;
+	if(mutex) 
+		next = mutex_unlock(mutex, 0);
+	else
+		Spin_Unlock(spinlock);
+	LOCK_PROF(lock_prof_sample ps = { cc_clock(), 0, 1 });
+	wchan_enter(waiter.thread, site);
+	sleep_releasing_waking(STOPPED, &(cv->waitset_lock), next, cause, timeout);
+	wchan_leave(waiter.thread);
+	LOCK_PROF(lock_prof_acquired(cv, site, &ps, cc_clock()));
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	Mcs_Lock(&(cv->waitset_lock));
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
 		remove_from_ring(cv, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
-
-	Mutex_Lock(mutex);
+	Mcs_Unlock(&(cv->waitset_lock));
+	if(preempt) preempt_on;
+
+	if(waiter.morphed) {
+		/* Woken up by Mutex_Unlock; we may have been handed the mutex */
+		if(waiter.mx_waiter.handoff) {
+			LOCK_PROF(lock_prof_sample mps = { 0, 0, 0 });
+			LOCK_PROF(mutex_prof_locked(mutex, site, &mps));
+		} else
+			mutex_lock_since(mutex, site, waiter.mx_waiter.since);
+	}
+	else if(mutex)
+		mutex_lock(mutex, site);
+	else
+		Spin_Lock(spinlock);
 	return waiter.signalled;
 }
 
@@ -176,96 +861,363 @@ static inline void cv_signal(CondVar* cv)
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
-	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+	return cv_wait(mutex, NULL, cv, SCHED_USER, NO_TIMEOUT, __FUNCTION__);
 }
 
 int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, NULL, cv, SCHED_USER, timeout*1000ul, __FUNCTION__);
+}
+
+#if defined(LOCK_PROFILING)
+int Cond_Wait_at(Mutex* mutex, CondVar* cv, const char* site)
+{
+	return cv_wait(mutex, NULL, cv, SCHED_USER, NO_TIMEOUT, site);
 }
 
+int Cond_TimedWait_at(Mutex* mutex, CondVar* cv, timeout_t timeout, const char* site)
+{
+	return cv_wait(mutex, NULL, cv, SCHED_USER, timeout*1000ul, site);
+}
+#endif
+
 
+/*
+  A waiter joins the waitset before it releases its mutex, and a signaller
+  normally locks the same mutex (or at least, takes the lock after the
+  condition changes). So, a signaller that finds the waitset empty without 
+  locking may skip the lock.
+ */
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  if(__atomic_load_n(&cv->waitset, __ATOMIC_ACQUIRE) == NULL) return;
+
+  int preempt = preempt_off;
+  Mcs_Lock(&(cv->waitset_lock));
   cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  Mcs_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
-void Cond_Broadcast(CondVar* cv)
+/**
+  @internal
+  Move a waiter of a condition variable to the wait queue of its mutex,
+  if the mutex is locked. The mutex owner will wake it up. Else, return 0;
+  then, the waiter must be woken up.
+
+  This must be called with the waitset lock held.
+ */
+static int cv_morph(__cv_waiter* w)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+	Mutex* mx = w->mutex;
+	Mcs_Lock(&mx->waitq_lock);
+
+	/* Announce the waiter, as mutex_lock_slow() does */
+	uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+	do {
+		if((owner & ~MUTEX_WAITERS) == 0) {
+			Mcs_Unlock(&mx->waitq_lock);
+			return 0;
+		}
+	} while(!(owner & MUTEX_WAITERS) && 
+		!__atomic_compare_exchange_n(&mx->owner, &owner, owner | MUTEX_WAITERS,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	__mx_waiter* mw = &w->mx_waiter;
+	*mw = (__mx_waiter) { .thread = w->thread, .since = cc_clock(), .handoff = 0 };
+	rlnode_init(&mw->node, mw);
+	if(mx->waitq == NULL)
+		mx->waitq = mw;
+	else
+		rlist_push_back(& ((__mx_waiter*) mx->waitq)->node, &mw->node);
+
+	w->morphed = 1;
+	w->signalled = 1;
+	Mcs_Unlock(&mx->waitq_lock);
+	return 1;
 }
 
 
+#define CV_BATCH 32
 
+static void cv_broadcast(CondVar* cv, TCB* waker)
+{
+  if(__atomic_load_n(&cv->waitset, __ATOMIC_ACQUIRE) == NULL) return;
+
+  __cv_waiter* waiters[CV_BATCH];
+  TCB* threads[CV_BATCH];
+  int woken[CV_BATCH];
+  uint n = 0;
+
+  int preempt = preempt_off;
+  Mcs_Lock(&(cv->waitset_lock));
+  while(cv->waitset || n > 0) {
+    if(cv->waitset) {
+      __cv_waiter* waiter = cv->waitset;
+      remove_from_ring(cv, waiter);
+      waiter->removed = 1;
+      if(waiter->mutex && cv_morph(waiter))
+        continue;
+      waiters[n] = waiter;
+      threads[n++] = waiter->thread;
+      if(n < CV_BATCH && cv->waitset) 
+        continue;
+    }
+
+    /* The waiters read their flags with the waitset lock held */
+    wakeup_batch(threads, woken, n, waker);
+    for(uint i = 0; i < n; i++)
+      waiters[i]->signalled = woken[i];
+    n = 0;
+  }
+  Mcs_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
+}
+
+void Cond_Broadcast(CondVar* cv)
+{
+  cv_broadcast(cv, cur_thread());
+}
 
 
 /*
- *
- * The kernel locks
- *
+	Reader-writer locks.
+	--------------------
+
+	The readers are counted per core: a reader increments the counter of
+	the core it runs on, and decrements the counter of the core it runs on
+	when it leaves, which may be another one. So, a single counter may be
+	negative, but the sum of the counters is the number of readers. The
+	writer word holds the TCB of the writer that holds or waits for the
+	lock.
+
+	A reader first increments its counter and then checks the writer word;
+	a writer first sets the writer word and then sums the counters. Both
+	use sequentially consistent atomics, so either the reader sees the
+	writer, or the writer sees the reader. A reader that sees a writer
+	backs off and waits, under the mutex, for the writer to leave. The
+	writer waits under the mutex for the sum of the counters to drop to 0;
+	a reader that leaves while there is a writer signals it.
+
+	The mutex is only locked by the slow paths: writers, and readers that
+	meet a writer.
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+_Static_assert(RWLOCK_SLOTS >= MAX_CORES, "RWLOCK_SLOTS is less than MAX_CORES");
+
+static inline long rwlock_readers(RWLock* rw)
+{
+	long sum = 0;
+	for(uint c = 0; c < RWLOCK_SLOTS; c++)
+		sum += __atomic_load_n(&rw->readers[c].count, __ATOMIC_SEQ_CST);
+	return sum;
+}
+
+static inline void rwlock_reader_add(RWLock* rw, long n)
+{
+	__atomic_add_fetch(&rw->readers[cpu_core_id].count, n, __ATOMIC_SEQ_CST);
+}
+
+static inline int rwlock_has_writer(RWLock* rw)
+{
+	return __atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST) != 0;
+}
+
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	rwlock_reader_add(rw, 1);
+	if(! rwlock_has_writer(rw))
+		return;
+
+	/* Back off, letting the writer know, and wait for it to leave */
+	rwlock_reader_add(rw, -1);
+	mutex_lock(&rw->mx, __FUNCTION__);
+	Cond_Signal(&rw->readers_done);
+	while(rw->writer)
+		cv_wait(&rw->mx, NULL, &rw->writer_done, SCHED_USER, NO_TIMEOUT, __FUNCTION__);
+	rwlock_reader_add(rw, 1);
+	Mutex_Unlock(&rw->mx);
+}
+
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	TCB* self = mutex_self();
+
+	mutex_lock(&rw->mx, __FUNCTION__);
+	while(rw->writer)
+		cv_wait(&rw->mx, NULL, &rw->writer_done, SCHED_USER, NO_TIMEOUT, __FUNCTION__);
+
+	/* Announce ourselves, then wait for the readers to leave */
+	__atomic_store_n(&rw->writer, (uintptr_t) self, __ATOMIC_SEQ_CST);
+	while(rwlock_readers(rw) != 0)
+		cv_wait(&rw->mx, NULL, &rw->readers_done, SCHED_USER, NO_TIMEOUT, __FUNCTION__);
+	Mutex_Unlock(&rw->mx);
+}
+
+
+void RWLock_Unlock(RWLock* rw)
+{
+	if(__atomic_load_n(&rw->writer, __ATOMIC_RELAXED) == (uintptr_t) mutex_self()) {
+		mutex_lock(&rw->mx, __FUNCTION__);
+		__atomic_store_n(&rw->writer, 0, __ATOMIC_SEQ_CST);
+		Cond_Broadcast(&rw->writer_done);
+		Mutex_Unlock(&rw->mx);
+		return;
+	}
+
+	rwlock_reader_add(rw, -1);
+	if(rwlock_has_writer(rw)) {
+		mutex_lock(&rw->mx, __FUNCTION__);
+		Cond_Signal(&rw->readers_done);
+		Mutex_Unlock(&rw->mx);
+	}
+}
+
+
+/*
+	Waiting on addresses.
+	---------------------
+
+	The threads waiting on addresses are kept in a hash table of wait
+	queues, keyed by the address. Each bucket has a ring of waiters, on
+	any of the addresses that hash to it, in FIFO order, and a queue
+	spinlock. A waiter checks the word with the bucket locked, and sleeps
+	releasing the lock, so a waker that changes the word and then locks
+	the bucket cannot miss it.
+
+	As with condition variables, the waiter lives on the stack of the
+	waiting thread, and it is removed from the ring either by the waker
+	or, after a timeout, by the waiter itself.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+#define FUTEX_BUCKETS 256	/* a power of 2 */
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+/** \cond HELPER Helper structure for address waiters. */
+typedef struct __futex_waiter {
+	rlnode node;		/* become part of the bucket ring */
+	TCB* thread;		/* thread to wait */
+	int* addr;			/* the address waited on */
+	int woken;			/* set if the thread is woken up */
+	int removed;		/* set if the waiter is removed from the ring */
+} __futex_waiter;
+/** \endcond */
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+typedef struct futex_bucket {
+	__futex_waiter* waiters;	/* the first waiter, or NULL */
+	McsLock lock;
+} __attribute__((aligned(64))) futex_bucket;
 
-void kernel_lock()
+static futex_bucket futex_table[FUTEX_BUCKETS];
+
+static inline futex_bucket* futex_bucket_of(int* addr)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	uintptr_t h = ((uintptr_t) addr >> 2) * 0x9E3779B1u;
+	return &futex_table[(h >> 8) & (FUTEX_BUCKETS - 1)];
+}
+
+static inline void futex_remove(futex_bucket* b, __futex_waiter* w)
+{
+	if(b->waiters == w) {
+		__futex_waiter* nextw = w->node.next->obj;
+		b->waiters = (nextw == w) ? NULL : nextw;
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+	rlist_remove(&w->node);
 }
 
-void kernel_unlock()
+
+int sys_WaitOnAddress(int* addr, int expected, timeout_t timeout)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	futex_bucket* b = futex_bucket_of(addr);
+	__futex_waiter waiter = { .thread = cur_thread(), .addr = addr, .woken = 0, .removed = 0 };
+	rlnode_init(&waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	Mcs_Lock(&b->lock);
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected) {
+		Mcs_Unlock(&b->lock);
+		if(preempt) preempt_on;
+		return 0;
+	}
+
+	if(b->waiters)
+		rlist_push_back(&b->waiters->node, &waiter.node);
+	else
+		b->waiters = &waiter;
+
+	wchan_enter(waiter.thread, __FUNCTION__);
+	sleep_releasing(STOPPED, &b->lock, SCHED_USER,
+		(timeout == WAIT_FOREVER) ? NO_TIMEOUT : timeout*1000ul);
+	wchan_leave(waiter.thread);
+
+	/* After a timeout, we must remove ourselves */
+	Mcs_Lock(&b->lock);
+	if(! waiter.removed)
+		futex_remove(b, &waiter);
+	Mcs_Unlock(&b->lock);
+	if(preempt) preempt_on;
+
+	return waiter.woken;
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+
+int sys_WakeAddress(int* addr, unsigned int n)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	futex_bucket* b = futex_bucket_of(addr);
+	if(n == 0) return 0;
+
+	/* The bucket must be locked even if it looks empty: a waiter may have
+	   read the old value of the word, and be about to join */
+
+	unsigned int woken = 0;
+	int preempt = preempt_off;
+	Mcs_Lock(&b->lock);
+
+	__futex_waiter* w = b->waiters;
+	__futex_waiter* last = w ? w->node.prev->obj : NULL;
+	while(w != NULL && woken < n) {
+		/* The next waiter, or NULL when the ring has been walked */
+		__futex_waiter* nextw = (w == last) ? NULL : w->node.next->obj;
+
+		if(w->addr == addr) {
+			futex_remove(b, w);
+			w->removed = 1;
+			if(wakeup(w->thread)) {
+				w->woken = 1;
+				woken++;
+			}
+		}
+		w = nextw;
+	}
+
+	Mcs_Unlock(&b->lock);
+	if(preempt) preempt_on;
+	return woken;
+}
+
+
+
+
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+/*
+ *
+ * Kernel waits
+ *
+ */
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, NULL, cv, cause, timeout, wchan_name);
+}
 
-	return ret;
+int kernel_spinwait_wchan(Spinlock* lock, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(NULL, lock, cv, cause, timeout, wchan_name);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +1230,7 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_broadcast_intr(CondVar* cv)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	cv_broadcast(cv, NULL);
 }
-
-
-
-
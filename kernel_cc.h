@@ -32,37 +32,101 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
- */
+/** @brief Lock a spinlock.
+
+	In the preemptive domain, the caller yields after spinning for a
+	while; in the non-preemptive domain, it spins for ever.
+  */
+void Spin_Lock(Spinlock* lock);
+
+/** @brief Unlock a spinlock.
+
+	If a thread of higher priority is waiting for the core (e.g., because 
+	it yielded while spinning on this lock), the caller yields to it.
+  */
+void Spin_Unlock(Spinlock* lock);
+
+/** @brief Lock a queue spinlock.
+
+	This must be called in the non-preemptive domain.
+  */
+void Mcs_Lock(McsLock* lock);
+
+/** @brief Unlock a queue spinlock. */
+void Mcs_Unlock(McsLock* lock);
+
+/** @brief Tell the core that the caller is spinning. */
+static inline void cpu_relax()
+{
+#if defined(__x86__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
 
+#if defined(LOCK_PROFILING)
 /**
-	@brief Lock the kernel.
- */
-void kernel_lock();
+	@brief Print the lock profile, and clear it.
 
+	This is called at shutdown. It prints the mutexes and condition 
+	variables, per call site, sorted by the time threads waited for them.
+  */
+void lock_profile_report();
+#endif
+
+#if defined(WCHAN_PROFILING)
 /**
-	@brief Unlock the kernel.
+	@brief Print the blocked time per wait channel, and clear it.
+
+	This is called at shutdown. It prints, for each wait channel, the
+	number of sleeps, and the total, average and maximum time blocked.
+  */
+void wchan_profile_report();
+#endif
+
+
+/*
+ * Kernel locking.
+ *
+ * There is no global kernel lock. Each kernel object is protected by its
+ * own lock (the process tree, each PCB, the file table, each device).
+ * These helpers wait on a kernel condition, releasing such a lock.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a kernel condition variable, releasing a kernel lock.
+
+	The caller must hold @c mx, which is released while the thread sleeps
+	and is re-acquired before returning.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
-	@brief Signal a kernel condition to one waiter.
+	@brief Wait on a kernel condition variable, releasing a spinlock.
+
+	This is like @c kernel_wait_wchan, for locks that are also taken
+	in the non-preemptive domain (e.g., by interrupt handlers).
 
-	This call must be made 
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_spinwait_wchan(Spinlock* lock, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan, TimerDuration timeout);
+
+#define kernel_spinwait(lock, cv, cause) \
+	kernel_spinwait_wchan((lock),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+
+/**
+	@brief Signal a kernel condition to one waiter.
   */
 void kernel_signal(CondVar* cv);
 
@@ -71,14 +135,13 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
-
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Signal a kernel condition to all waiters, from an interrupt handler.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	The waiters are not woken up on behalf of the interrupted thread, so
+	each one is queued at the core it last ran on.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_broadcast_intr(CondVar* cv);
 
 
 
@@ -68,8 +68,9 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Spinlock spinlock;  /* Protects reads; locked with preemption off */
   CondVar rx_ready;
+  Mutex tx_mutex;     /* Serializes writes */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -90,7 +91,9 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
-    Cond_Broadcast(&dcb->rx_ready);
+    Spin_Lock(&dcb->spinlock);
+    kernel_broadcast_intr(&dcb->rx_ready);
+    Spin_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -103,22 +106,24 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Spin_Lock(&dcb->spinlock);
 
   uint count =  0;
 
   while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+    int n = bios_read_serial_block(dcb->devno, &buf[count], size-count);
     
-    if (valid) {
-      count++;
+    if (n>0) {
+      count += n;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_spinwait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Spin_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -143,12 +148,14 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  Mutex_Lock(&dcb->tx_mutex);
+
   unsigned int count = 0;
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+    int n = bios_write_serial_block(dcb->devno, &buf[count], size-count);
 
-    if(success) {
-      count++;
+    if(n>0) {
+      count += n;
     } 
     else if(count==0)
     {
@@ -158,6 +165,8 @@ int serial_write(void* dev, const char* buf, unsigned int size)
       break;
   }
 
+  Mutex_Unlock(&dcb->tx_mutex);
+
   return count;  
 }
 
@@ -210,7 +219,8 @@ void initialize_devices()
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].spinlock = SPINLOCK_INIT;
+    serial_dcb[i].tx_mutex = MUTEX_INIT;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -53,8 +54,18 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  /* Wait for all cores to leave the scheduler */
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+    finalize_scheduler();
+#if defined(LOCK_PROFILING)
+    lock_profile_report();
+#endif
+#if defined(WCHAN_PROFILING)
+    wchan_profile_report();
+#endif
   }
 }
 
@@ -22,9 +22,12 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* The lock of the process tree */
+Mutex proc_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  return __atomic_load_n(&PT[pid].pstate, __ATOMIC_ACQUIRE)==FREE ? NULL : &PT[pid];
 }
 
 Pid_t get_pid(PCB* pcb)
@@ -32,14 +35,74 @@ Pid_t get_pid(PCB* pcb)
   return pcb==NULL ? NOPROC : pcb-PT;
 }
 
+/*
+  Updates of the process tree that lock-free readers may see are
+  bracketed by these, with proc_lock held. While the sequence counter
+  is odd, the PCB is being updated.
+*/
+static inline void pcb_write_begin(PCB* pcb)
+{
+  __atomic_store_n(&pcb->seq, pcb->seq+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void pcb_write_end(PCB* pcb)
+{
+  __atomic_store_n(&pcb->seq, pcb->seq+1, __ATOMIC_RELEASE);
+}
+
+/* Read a PCB into info; the caller validates the result */
+static int pcb_read(PCB* pcb, procinfo* info)
+{
+  pid_state pstate = __atomic_load_n(&pcb->pstate, __ATOMIC_RELAXED);
+  if(pstate == FREE) return 0;
+
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(__atomic_load_n(&pcb->parent, __ATOMIC_RELAXED));
+  info->alive = (pstate == ALIVE);
+  info->thread_count = __atomic_load_n(&pcb->thread_count, __ATOMIC_RELAXED);
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+  int len = info->argl;
+  if(len > PROCINFO_MAX_ARGS_SIZE) len = PROCINFO_MAX_ARGS_SIZE;
+  if(len > 0) memcpy(info->args, pcb->info_args, len);
+  return 1;
+}
+
+/* How many times a reader retries, before it locks proc_lock */
+#define SNAPSHOT_TRIES 16
+
+int pcb_snapshot(PCB* pcb, procinfo* info)
+{
+  for(int tries = 0; tries < SNAPSHOT_TRIES; tries++) {
+    unsigned int seq = __atomic_load_n(&pcb->seq, __ATOMIC_ACQUIRE);
+    if(seq & 1) {
+      cpu_relax();
+      continue;
+    }
+    int used = pcb_read(pcb, info);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&pcb->seq, __ATOMIC_RELAXED) == seq)
+      return used;
+  }
+
+  /* The writer may have been preempted in the middle of the update */
+  Mutex_Lock(&proc_lock);
+  int used = pcb_read(pcb, info);
+  Mutex_Unlock(&proc_lock);
+  return used;
+}
+
 /* Initialize a PCB */
 static inline void initialize_PCB(PCB* pcb)
 {
+  pcb->seq = 0;
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
   pcb->thread_count = 0;
 
+  pcb->lock = MUTEX_INIT;
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
 
@@ -93,7 +156,8 @@ void initialize_ptcb(PTCB* ptcb, int argl, void* args, Task task)
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held. The new PCB is returned in
+  a write section, which the caller ends once it is initialized.
 */
 PCB* acquire_PCB()
 {
@@ -101,7 +165,8 @@ PCB* acquire_PCB()
 
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
-    pcb->pstate = ALIVE;
+    pcb_write_begin(pcb);
+    __atomic_store_n(&pcb->pstate, ALIVE, __ATOMIC_RELAXED);
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
@@ -118,12 +183,14 @@ PTCB* acquire_PTCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
-  pcb->pstate = FREE;
+  pcb_write_begin(pcb);
+  __atomic_store_n(&pcb->pstate, FREE, __ATOMIC_RELAXED);
   pcb->parent = pcb_freelist;
+  pcb_write_end(pcb);
   pcb_freelist = pcb;
   process_count--;
 }
@@ -143,7 +210,7 @@ void start_multiThread()
   void* args = cur_thread() ->owner_ptcb->args;
 
   exitval = call(argl,args);
-  sys_ThreadExit(exitval);
+  ThreadExit(exitval);
 
 }
 
@@ -170,6 +237,8 @@ void start_main_thread()
 Pid_t sys_Exec(Task call, int argl, void* args)
 {
   PCB *curproc, *newproc;
+
+  Mutex_Lock(&proc_lock);
   
  /* The new process PCB */
   newproc = acquire_PCB();
@@ -191,11 +260,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
+    Mutex_Lock(&curproc->lock);
     for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
+       newproc->FIDT[i] = get_fcb(i);
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(&curproc->lock);
   }
 
   /* Set the main thread's function */
@@ -206,9 +277,16 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   if(args!=NULL) {
     newproc->args = malloc(argl);
     memcpy(newproc->args, args, argl);
+    memcpy(newproc->info_args, args, 
+      argl < PROCINFO_MAX_ARGS_SIZE ? argl : PROCINFO_MAX_ARGS_SIZE);
   }
-  else
+  else {
+    /* The PCB is reused; do not show the args of its last process */
     newproc->args=NULL;
+    memset(newproc->info_args, 0, sizeof(newproc->info_args));
+  }
+
+  pcb_write_end(newproc);
 
   /* 
     Create and wake up the thread for the main function. This must be the last thing
@@ -223,10 +301,11 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   initialize_ptcb(ptcb, argl, args, call);
  
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, THREAD_STACK_SIZE);
     newproc->thread_count++;
     newproc->main_thread->owner_ptcb = ptcb;
     ptcb->tcb = newproc->main_thread;
+    ptcb->priority = ptcb->tcb->static_priority;
     rlist_push_back(&newproc->PTCB_list, &ptcb->PTCB_node);
     assert(ptcb != NULL);
     assert(newproc->main_thread != NULL);
@@ -237,6 +316,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
 
 finish:
+  Mutex_Unlock(&proc_lock);
   return get_pid(newproc);
 }
 
@@ -250,7 +330,7 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_ACQUIRE));
 }
 
 
@@ -285,7 +365,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -309,7 +389,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -326,28 +406,24 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Mutex_Lock(&proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(&proc_lock);
+  return cpid;
 }
 
-void sys_Exit(int exitval)
+void exit_process()
 {
-
   PCB *curproc = CURPROC;  /* cache for efficiency */
-  TCB* curthread = cur_thread();
-  PTCB* curptcb = curthread->owner_ptcb;
-
-  //printf("sys_Exit: process %d, thread %p exiting...\n",get_pid(CURPROC), sys_ThreadSelf());
-
-  /* First, store the exit status */
-  curproc->exitval = exitval;
 
   /* 
     Here, we must check that we are not the init task. 
@@ -355,16 +431,37 @@ void sys_Exit(int exitval)
    */
   if(get_pid(curproc)==1) {
 
-    while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
+    Mutex_Lock(&proc_lock);
+    while(wait_for_any_child(NULL)!=NOPROC);
+    Mutex_Unlock(&proc_lock);
 
-  }else {
+  }
+
+  /* 
+    Clean up FIDT. Closing a stream may take a while, so this is
+    done under the process lock only, before taking proc_lock.
+   */
+  for(int i=0;i<MAX_FILEID;i++) {
+    Mutex_Lock(&curproc->lock);
+    FCB* fcb = curproc->FIDT[i];
+    curproc->FIDT[i] = NULL;
+    Mutex_Unlock(&curproc->lock);
+    if(fcb != NULL)
+      FCB_decref(fcb);
+  }
+
+  Mutex_Lock(&proc_lock);
+
+  if(get_pid(curproc)!=1) {
 
     /* Reparent any children of the exiting process to the 
        initial task */
     PCB* initpcb = get_pcb(1);
     while(!is_rlist_empty(& curproc->children_list)) {
       rlnode* child = rlist_pop_front(& curproc->children_list);
-      child->pcb->parent = initpcb;
+      pcb_write_begin(child->pcb);
+      __atomic_store_n(&child->pcb->parent, initpcb, __ATOMIC_RELAXED);
+      pcb_write_end(child->pcb);
       rlist_push_front(& initpcb->children_list, child);
     }
 
@@ -384,25 +481,38 @@ void sys_Exit(int exitval)
   assert(is_rlist_empty(& curproc->children_list));
   assert(is_rlist_empty(& curproc->exited_list));
  
-  /* 
-    Do all the other cleanup we want here, close files etc. 
-   */
-
-  /* Release the args data */
+  /* Release the args data. Lock-free readers use info_args instead. */
   if(curproc->args) {
     free(curproc->args);
     curproc->args = NULL;
   }
 
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  /* Disconnect my main_thread */
+  curproc->main_thread = NULL;
+
+  /* Now, mark the process as exited. */
+  pcb_write_begin(curproc);
+  __atomic_store_n(&curproc->pstate, ZOMBIE, __ATOMIC_RELAXED);
+  pcb_write_end(curproc);
+
+  /* Bye-bye cruel world. The parent may clean up the zombie as
+     soon as proc_lock is released; this thread does not touch it again. */
+  Mutex_Unlock(&proc_lock);
+  sleep_releasing(EXITED, NULL, SCHED_USER, NO_TIMEOUT);
+}
+
+
+void sys_Exit(int exitval)
+{
 
-  //printf("sys_Exit: thread %p refcount=%d\n", curptcb, curptcb->refcount);
+  PCB *curproc = CURPROC;  /* cache for efficiency */
+  TCB* curthread = cur_thread();
+  PTCB* curptcb = curthread->owner_ptcb;
+
+  /* First, store the exit status */
+  curproc->exitval = exitval;
+
+  Mutex_Lock(&curproc->lock);
 
    /* Send a signal to the waiting processes if there are  */
   if(curptcb->refcount != 0){
@@ -412,18 +522,70 @@ void sys_Exit(int exitval)
   /* Set current ptcp as exited (join threads must exit) */ 
   curptcb->exited = 1;
 
-  /* Disconnect my main_thread */
-  curproc->main_thread = NULL;
+  Mutex_Unlock(&curproc->lock);
 
-  /* Now, mark the process as exited. */
-  curproc->pstate = ZOMBIE;
+  exit_process();
+}
+
+
+/*
+  The process information stream. It walks the process table without 
+  locking it, so that Exec and Exit are not stalled by it.
+*/
+typedef struct procinfo_control_block {
+  Pid_t cursor;     /* The next pid to read */
+} procinfo_cb;
+
+
+static int procinfo_read(void* this, char* buf, unsigned int size)
+{
+  procinfo_cb* picb = this;
+
+  if(size < sizeof(procinfo)) return -1;
+
+  while(picb->cursor < MAX_PROC) {
+    PCB* pcb = &PT[picb->cursor++];
+    if(pcb_snapshot(pcb, (procinfo*) buf))
+      return sizeof(procinfo);
+  }
+  return 0;
+}
+
+static int procinfo_write(void* this, const char* buf, unsigned int size)
+{
+  return -1;
+}
 
-  /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+static int procinfo_close(void* this)
+{
+  free(this);
+  return 0;
 }
 
+static file_ops procinfo_ops = {
+  .Read = procinfo_read,
+  .Write = procinfo_write,
+  .Close = procinfo_close
+};
+
 
 Fid_t sys_OpenInfo()
 {
-	return NOFILE;
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  procinfo_cb* picb = xmalloc(sizeof(procinfo_cb));
+  picb->cursor = 0;
+
+  /* Make the stream visible */
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->lock);
+  fcb->streamobj = picb;
+  fcb->streamfunc = &procinfo_ops;
+  Mutex_Unlock(& cur->lock);
+
+  return fid;
 }
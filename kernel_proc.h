@@ -12,6 +12,20 @@
   This file defines the PCB structure and basic helpers for
   process access.
 
+  Locking: the process tree (the PCB free list, the @c pstate, @c parent,
+  @c children_list and @c exited_list of each PCB) is protected by
+  @c proc_lock. The file table and the threads of a process (@c FIDT,
+  @c PTCB_list, @c thread_count and the PTCBs) are protected by the
+  @c lock of its PCB. When both are needed, @c proc_lock is locked first.
+
+  Read-only queries (@ref get_pcb, @c GetPid, @c GetPPid and the
+  @c OpenInfo stream) do not lock @c proc_lock. PCBs live in the static
+  table @c PT and are never freed, so a PCB pointer is always safe to
+  dereference. The writers (who hold @c proc_lock) bump the @c seq
+  counter of a PCB around each update, and a reader takes a consistent
+  snapshot by retrying while @c seq is odd or has changed (see
+  @ref pcb_snapshot).
+
   @{
 */ 
 
@@ -37,6 +51,7 @@ typedef enum pid_state_e {
   This structure holds all information pertaining to a process.
  */
 typedef struct process_control_block {
+  unsigned int seq;       /**< @brief Sequence counter, odd while the PCB is updated */
   pid_state  pstate;      /**< @brief The pid state for this PCB */
 
   PCB* parent;            /**< @brief Parent's pcb. */
@@ -46,6 +61,8 @@ typedef struct process_control_block {
   Task main_task;         /**< @brief The main thread's function */
   int argl;               /**< @brief The main thread's argument length */
   void* args;             /**< @brief The main thread's argument string */
+  char info_args[PROCINFO_MAX_ARGS_SIZE];  /**< @brief A prefix of @c args, kept
+                             for lock-free readers, since @c args is freed at exit */
 
   rlnode children_list;   /**< @brief List of children */
   rlnode exited_list;     /**< @brief List of exited children */
@@ -59,6 +76,7 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
+  Mutex lock;             /**< @brief Protects @c FIDT and the threads of the process */
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
   rlnode PTCB_list;
   int thread_count;
@@ -76,6 +94,7 @@ typedef struct process_thread_control_block{
   void* args;
 
   int exitval;
+  int priority; /**< @brief The static priority of the thread, kept after it exits */
 
   int exited;
   int detached;
@@ -93,6 +112,20 @@ typedef struct process_thread_control_block{
 
 void start_multiThread();
 
+/**
+  @brief The lock of the process tree.
+*/
+extern Mutex proc_lock;
+
+/**
+  @brief Turn the current process into a zombie, and exit the current thread.
+
+  This is called when the last thread of a process exits, or when the
+  process calls @c Exit. It must be called without holding any lock. 
+  It does not return.
+*/
+void exit_process();
+
 /**
   @brief Initialize the process table.
 
@@ -141,6 +174,19 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Take a consistent snapshot of a PCB, without locking.
+
+  This fills @c info with the state of the PCB, as it was at some point
+  during the call. It does not lock @c proc_lock, unless the PCB is
+  being updated for too long.
+
+  @param pcb the pcb to read
+  @param info the snapshot
+  @returns 1 if the PCB was in use, or 0 if it was free.
+*/
+int pcb_snapshot(PCB* pcb, procinfo* info);
+
 /** @} */
 
 #endif
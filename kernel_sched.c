@@ -40,13 +40,23 @@ CCB cctx[MAX_CORES];
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
+
+	Turning preemption off and on would cost two system calls. Instead,
+	the current thread of the core is read between two reads of the core's
+	switch count. If the count is unchanged, the caller was not switched
+	out in between, and so it did not move to another core.
  */
 TCB* cur_thread()
 {
-  int preempt = preempt_off;
-  TCB* cur = CURTHREAD;
-  if(preempt) preempt_on;
-  return cur;
+	while (1) {
+		uint id = cpu_core_id;
+		CCB* core = &cctx[id];
+		uint switches = __atomic_load_n(&core->switches, __ATOMIC_ACQUIRE);
+		TCB* cur = __atomic_load_n(&core->current_thread, __ATOMIC_ACQUIRE);
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		if (cpu_core_id == id && __atomic_load_n(&core->switches, __ATOMIC_ACQUIRE) == switches)
+			return cur;
+	}
 }
 
 
@@ -55,24 +65,26 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  The stack grows downward. Each thread occupies a block of virtual memory,
+  with the TCB at the top, the stack below it, and a guard page at the bottom:
 
   +-------------+
   |   TCB       |
+  +-------------+  <-- initial stack pointer
+  | first frame |
   +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
   +-------------+
+  | guard page  |  (PROT_NONE)
+  +-------------+  <-- start of the block
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Advantages: (a) unified memory area for stack and TCB (b) a stack overrun
+  hits the guard page and crashes with a segmentation fault, before it
+  affects other threads.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
@@ -80,10 +92,10 @@ TCB* cur_thread()
 
 /*
   A counter for active threads. By "active", we mean 'existing',
-  with the exception of idle threads (they don't count).
+  with the exception of idle threads (they don't count). It is updated
+  atomically.
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -92,43 +104,287 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The guard page below each stack */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+/* The number of stack size classes. Class c has stacks of
+   THREAD_STACK_MIN << c bytes; the last class has THREAD_STACK_MAX. */
+#define THREAD_STACK_CLASSES 10
+#define STACK_CLASS_SIZE(c) ((size_t)THREAD_STACK_MIN << (c))
+
+/* The size of a thread block whose stack has the given size */
+#define THREAD_BLOCK_SIZE(stack_size) (THREAD_GUARD_SIZE + (stack_size) + THREAD_TCB_SIZE)
+
+/* The start of the thread block (the guard page) of a TCB */
+#define THREAD_BLOCK(tcb) ((void*)(tcb) - (tcb)->stack_size - THREAD_GUARD_SIZE)
+
+
+/*
+  The thread arena.
+  -----------------
+
+  Thread blocks are carved out of large regions of virtual memory (chunks),
+  reserved by mmap with PROT_NONE and MAP_NORESERVE. Reserving costs no 
+  memory; when a block is first allocated, its stack and TCB are made 
+  accessible by mprotect, and the kernel commits their pages lazily, as 
+  they are touched. The guard page is never made accessible.
+
+  Blocks are never returned to the system before the VM shuts down. A free 
+  block is kept in the free list of its size class, linked through an rlnode
+  at the start of its TCB. The pages of its stack are released by 
+  madvise(MADV_DONTNEED), so that a free block holds only the TCB pages.
+  Because of this, a thread that touches only a few pages of stack costs 
+  only a few pages of resident memory.
+
+  The arena is protected by thread_arena_lock, and must be accessed in the
+  non-preemptive domain.
+ */
+
+#ifndef THREAD_ARENA_CHUNK
+#define THREAD_ARENA_CHUNK ((size_t)1 << 34)
+#endif
+
+#define THREAD_ARENA_MAX_CHUNKS 64
+
+typedef struct thread_chunk {
+	void* base;    /* The start of the reserved region */
+	size_t size;   /* The size of the reserved region */
+	size_t used;   /* The part of the region already given to blocks */
+} thread_chunk;
+
+static thread_chunk thread_arena[THREAD_ARENA_MAX_CHUNKS];
+static uint thread_arena_chunks;
+static rlnode thread_free_list[THREAD_STACK_CLASSES];
+static Spinlock thread_arena_lock = SPINLOCK_INIT;
+
+
+/* Return the size class of a stack size. Sizes are rounded up, and
+   sizes larger than THREAD_STACK_MAX are capped. */
+static uint stack_class(size_t stack_size)
+{
+	uint c = 0;
+	while (c < THREAD_STACK_CLASSES - 1 && STACK_CLASS_SIZE(c) < stack_size)
+		c++;
+	return c;
+}
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* Reserve a new chunk, large enough for a block of the given size.
+   If the address space is short, try smaller chunks. */
+static thread_chunk* thread_arena_grow(size_t block_size)
+{
+	if (thread_arena_chunks == THREAD_ARENA_MAX_CHUNKS)
+		FATAL("The thread arena is exhausted");
+
+	for (size_t size = THREAD_ARENA_CHUNK; size >= block_size; size /= 2) {
+		void* ptr = mmap(NULL, size, PROT_NONE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (ptr != MAP_FAILED) {
+			thread_chunk* chunk = &thread_arena[thread_arena_chunks++];
+			*chunk = (thread_chunk) { .base = ptr, .size = size, .used = 0 };
+			return chunk;
+		}
+	}
+
+	FATAL("Cannot reserve memory for threads");
+	return NULL;
+}
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Allocate a thread block with the given stack size (a size class), and
+  return the address of its TCB.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+static TCB* allocate_thread(size_t stack_size)
+{
+	uint c = stack_class(stack_size);
+	size_t block_size = THREAD_BLOCK_SIZE(STACK_CLASS_SIZE(c));
+	void* block = NULL;
+
+	Spin_Lock(&thread_arena_lock);
+	if (!is_rlist_empty(&thread_free_list[c])) {
+		TCB* tcb = (TCB*) rlist_pop_front(&thread_free_list[c]);
+		Spin_Unlock(&thread_arena_lock);
+		return tcb;
+	}
+	thread_chunk* chunk = (thread_arena_chunks == 0) ? NULL : &thread_arena[thread_arena_chunks - 1];
+	if (chunk == NULL || chunk->size - chunk->used < block_size)
+		chunk = thread_arena_grow(block_size);
+	block = chunk->base + chunk->used;
+	chunk->used += block_size;
+	Spin_Unlock(&thread_arena_lock);
 
-void* allocate_thread(size_t size)
+	CHECK(mprotect(block + THREAD_GUARD_SIZE, block_size - THREAD_GUARD_SIZE, PROT_READ | PROT_WRITE));
+
+	TCB* tcb = block + block_size - THREAD_TCB_SIZE;
+	tcb->stack_size = STACK_CLASS_SIZE(c);
+	return tcb;
+}
+
+/* Release the stack pages of a thread block. */
+static void thread_stack_release(TCB* tcb)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	CHECK(madvise(THREAD_BLOCK(tcb) + THREAD_GUARD_SIZE, tcb->stack_size, MADV_DONTNEED));
+}
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+/* Return a thread block to the free list of its class */
+static void free_thread(TCB* tcb)
+{
+	uint c = stack_class(tcb->stack_size);
+	thread_stack_release(tcb);
 
-	return ptr;
+	Spin_Lock(&thread_arena_lock);
+	rlist_push_front(&thread_free_list[c], rlnode_new((rlnode*) tcb));
+	Spin_Unlock(&thread_arena_lock);
 }
-#else
+
+
+/*
+  The thread cache.
+  -----------------
+
+  Allocating a thread block from the arena takes a global lock, and
+  possibly system calls. To make thread creation and exit cheap, freed
+  blocks with the default stack size (THREAD_STACK_SIZE) are kept in a
+  cache, and reused. Blocks of other sizes go straight to the arena.
+
+  Each core has a 'magazine', a small stack of free blocks, which it
+  accesses without locking (in the non-preemptive domain). Behind the
+  magazines there is a global 'depot', a list of free blocks protected
+  by a spinlock.
+
+  When a magazine is empty, it is refilled from the depot with up to
+  THREAD_CACHE_LOW blocks; if the depot is empty too, a new block is
+  allocated. When a magazine is full (THREAD_CACHE_HIGH blocks), it is
+  flushed down to THREAD_CACHE_LOW blocks, into the depot. The stacks of
+  blocks in the depot are released (see thread_stack_release). The depot
+  keeps at most THREAD_DEPOT_MAX blocks, the rest are returned to the arena.
+ */
+
+#if 0
+#define THREAD_CACHE_STATISTICS
+#endif
+
+#ifndef THREAD_CACHE_HIGH
+#define THREAD_CACHE_HIGH 16
+#endif
+
+#ifndef THREAD_CACHE_LOW
+#define THREAD_CACHE_LOW 8
+#endif
+
+#ifndef THREAD_DEPOT_MAX
+#define THREAD_DEPOT_MAX 256
+#endif
+
+typedef struct thread_magazine {
+	TCB* block[THREAD_CACHE_HIGH];  /* The free blocks */
+	uint count;                     /* The number of free blocks */
+
+	unsigned long hits;        /* Blocks found in the magazine */
+	unsigned long depot_hits;  /* Blocks found in the depot */
+	unsigned long misses;      /* Blocks allocated from the system */
+} thread_magazine;
+
+static thread_magazine thread_mag[MAX_CORES];
+
+/* Free blocks in the depot are linked through an rlnode at the start of the TCB */
+static rlnode thread_depot;
+static uint thread_depot_count;
+static Spinlock thread_depot_lock = SPINLOCK_INIT;
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Get a thread block from the cache.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+static TCB* thread_cache_get()
+{
+	thread_magazine* mag = &thread_mag[cpu_core_id];
+
+	if (mag->count > 0) {
+		mag->hits++;
+		return mag->block[--mag->count];
+	}
+
+	/* Refill from the depot */
+	Spin_Lock(&thread_depot_lock);
+	while (mag->count < THREAD_CACHE_LOW && thread_depot_count > 0) {
+		mag->block[mag->count++] = (TCB*) rlist_pop_front(&thread_depot);
+		thread_depot_count--;
+	}
+	Spin_Unlock(&thread_depot_lock);
+
+	if (mag->count > 0) {
+		mag->depot_hits++;
+		return mag->block[--mag->count];
+	}
+
+	mag->misses++;
+	return allocate_thread(THREAD_STACK_SIZE);
+}
 
-void* allocate_thread(size_t size)
+/*
+  Return a thread block to the cache.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+ */
+static void thread_cache_put(TCB* block)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	thread_magazine* mag = &thread_mag[cpu_core_id];
+
+	if (mag->count == THREAD_CACHE_HIGH) {
+		/* Flush to the depot */
+		Spin_Lock(&thread_depot_lock);
+		while (mag->count > THREAD_CACHE_LOW && thread_depot_count < THREAD_DEPOT_MAX) {
+			TCB* tcb = mag->block[--mag->count];
+			thread_stack_release(tcb);
+			rlist_push_back(&thread_depot, rlnode_new((rlnode*) tcb));
+			thread_depot_count++;
+		}
+		Spin_Unlock(&thread_depot_lock);
+
+		/* The depot is full */
+		while (mag->count > THREAD_CACHE_LOW)
+			free_thread(mag->block[--mag->count]);
+	}
+
+	mag->block[mag->count++] = block;
 }
+
+/*
+  Empty the cache. This is called when the scheduler has stopped on all
+  cores; the blocks go back to the system with the arena.
+ */
+static void thread_cache_drain()
+{
+	for (uint c = 0; c < MAX_CORES; c++) {
+		thread_magazine* mag = &thread_mag[c];
+
+#if defined(THREAD_CACHE_STATISTICS)
+		if (c < cpu_cores())
+			fprintf(stderr, "Core %3u: thread cache hits=%lu depot hits=%lu misses=%lu\n",
+				c, mag->hits, mag->depot_hits, mag->misses);
 #endif
 
+		mag->count = 0;
+	}
+
+	rlnode_init(&thread_depot, NULL);
+	thread_depot_count = 0;
+}
+
+/*
+  Return the whole arena to the system. This is called when the
+  scheduler has stopped on all cores.
+ */
+static void thread_arena_release()
+{
+	for (uint i = 0; i < thread_arena_chunks; i++)
+		CHECK(munmap(thread_arena[i].base, thread_arena[i].size));
+	thread_arena_chunks = 0;
 
+	for (uint c = 0; c < THREAD_STACK_CLASSES; c++)
+		rlnode_init(&thread_free_list[c], NULL);
+}
 
 
 /*
@@ -150,10 +406,14 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb,void (*func)())
+TCB* spawn_thread(PCB* pcb,void (*func)(), size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+
+	int preempt = preempt_off;
+	TCB* tcb = (stack_class(stack_size) == stack_class(THREAD_STACK_SIZE))
+		? thread_cache_get() : allocate_thread(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -163,34 +423,48 @@ TCB* spawn_thread(PCB* pcb,void (*func)())
 	tcb->state = INIT;
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
-	tcb->wakeup_time = NO_TIMEOUT;
+	timer_node_init(&tcb->wakeup_timer, tcb);
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
+	/* A new thread inherits the static priority of its creator */
+	TCB* parent = CURCORE.current_thread;
+	tcb->priority = 0;
+	tcb->static_priority = (parent != NULL && parent->type != IDLE_THREAD)
+		? parent->static_priority : PRIORITY_DEFAULT;
+	tcb->edf = (edf_params) { .runtime = 0 };
+	tcb->edf_admitted = tcb->edf;
+	tcb->edf_changed = 0;
+	tcb->queue_core = -1;
+	tcb->last_core = cpu_core_id;
+	tcb->last_waker = NULL;
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
+	tcb->wchan = NULL;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = THREAD_BLOCK(tcb) + THREAD_GUARD_SIZE;
 
-	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	/* Init the context. The context inherits the current signal mask, and
+	   thread_start() must begin in the non-preemptive domain, since an
+	   interrupt before gain() would confuse the scheduler. */
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
+	if (preempt)
+		preempt_on;
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called in the non-preemptive domain, from gain().
  */
 void release_TCB(TCB* tcb)
 {
@@ -198,11 +472,16 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	/* Give back the reservation of the deadline class */
+	if (tcb->edf_admitted.runtime != 0)
+		sched_edf_admit(tcb, 0, 0, 0);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_cache_put(tcb);
+	else
+		free_thread(tcb);
+
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELAXED);
 }
 
 /*
@@ -216,29 +495,98 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
+  Each core has its own scheduler queue, stored in its CCB (field 
+  ready_queue), and protected by the core's ready_lock. The queue is an 
+  array of doubly linked lists, one for each pair of static priority and 
+  feedback level. For each static priority, the lists of the feedback 
+  levels form a multilevel feedback queue. A thread is queued at list
+  SCHED_QUEUE(static_priority, priority); lower lists come first. The bits
+  of ready_mask tell which lists are non-empty, so that the first non-empty
+  list is found in O(1) time.
+
+  A core selects threads from the head of its first non-empty list. When a
+  core would otherwise become idle, it steals a thread from the tail of the
+  first non-empty list of some other core, chosen at random.
+
+  A thread is preempted at once, by an inter-core interrupt, when a thread 
+  of a higher static priority is queued at its core. Threads of the same 
+  static priority share the core in time slices, and threads of lower 
+  static priority wait until the core has no higher priority work.
+
+  Deadline class.
+  ---------------
+
+  Threads of the deadline class come before all others. They are queued at
+  list SCHED_EDF_QUEUE, sorted by the absolute deadline of their current 
+  job, so that the core runs the earliest deadline first (EDF). A thread 
+  with an earlier deadline preempts the current one. 
+
+  Each deadline thread is admitted to a core, and is always queued there 
+  (partitioned EDF). Admission control keeps the sum of runtime/period of
+  the threads of each core within EDF_CAPACITY; under this bound, EDF meets
+  all deadlines when deadline == period. The time slice of a deadline 
+  thread is the budget of its job, and the time it runs is charged to the 
+  budget. A thread that exhausts its budget is scheduled as a normal 
+  thread, until its next job is released; so, a misbehaving deadline 
+  thread cannot starve the others.
+
+  A preempted thread is queued back at its core. A thread that wakes up is 
+  queued at the core it last ran on, if that core is less loaded than the
+  waker's core, else at the waker's core. A thread woken repeatedly by the
+  same thread always goes to the waker's core (see sched_wakeup_core). A
+  thread woken by a timeout or an interrupt handler goes to its last core.
+  A core that queues a thread at another core sends it an inter-core
+  interrupt.
+  A preempted thread, which has to wait behind the next one, is offered to
+  a halted core to steal; a woken thread stays where it was placed.
+  Each core counts the threads that migrate to it.
+
+  Also, the scheduler contains a timer wheel with all the sleeping
   threads with a timeout.
 
-  Both of these structures are protected by @c sched_spinlock.
+  The sched_spinlock protects the TIMEOUT_WHEEL, and the transitions of
+  threads from and to the STOPPED state, i.e., it synchronizes
+  sleep_releasing() with wakeup(). Threads yielding their quantum do not
+  need to touch it. Since all cores contend for it, it is a queue spinlock.
+
+  The lock order is: sched_spinlock before ready_lock.
+
+  Tickless scheduling.
+  --------------------
+
+  The ALARM timer of a core is armed only when it can be of use: when 
+  threads are waiting in the core's queue, to end the time slice of the
+  current thread, or when a sleep timeout is pending, to wake up its 
+  thread. Otherwise, the current thread runs without interruption, and 
+  an idle core halts until it is restarted or interrupted by a device.
+
+  When the timer is not armed, the time slice is measured by bios_clock(),
+  from slice_start. When a thread is queued at a core whose current thread
+  runs without an alarm, sched_queue_add() arms the timer for the rest of
+  the slice.
+
+  Define SCHED_TICKLESS as 0 to arm the timer on every time slice.
 */
 
-rlnode SCHED; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+#ifndef SCHED_TICKLESS
+#define SCHED_TICKLESS 1
+#endif
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+#if 0
+#define SCHED_STATISTICS
+#endif
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
-}
+timer_wheel TIMEOUT_WHEEL; /* The threads with a timeout */
+McsLock sched_spinlock = MCS_LOCK_INIT; /* spinlock for sleeping and waking up */
+
+/* The earliest wakeup time in TIMEOUT_WHEEL (it may be stale, but never late) */
+static volatile TimerDuration sched_next_timeout = NO_TIMEOUT;
+
+static void sched_arm_timer(CCB* core, TCB* current); /* forward */
+static int sched_edf_apply(TCB* tcb); /* forward */
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timer wheel.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
@@ -246,95 +594,518 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		TimerDuration wakeup_time = bios_clock() + timeout;
+		timer_add(&TIMEOUT_WHEEL, &tcb->wakeup_timer, wakeup_time);
+
+		if (wakeup_time < sched_next_timeout)
+			sched_next_timeout = wakeup_time;
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Return the list of a core's queue where a thread is queued.
+ */
+static inline uint sched_thread_queue(TCB* tcb)
+{
+	return sched_edf_active(tcb) ? SCHED_EDF_QUEUE 
+		: SCHED_QUEUE(tcb->static_priority, tcb->priority);
+}
+
+/*
+  Return true if thread a should preempt thread b: it is of a lower band,
+  or both are deadline threads and a has an earlier deadline.
+ */
+static inline int sched_thread_preempts(TCB* a, TCB* b)
+{
+	uint band = sched_thread_band(a);
+	if (band != sched_thread_band(b))
+		return band < sched_thread_band(b);
+	return band == 0 && a->edf.abs_deadline < b->edf.abs_deadline;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Add TCB to the end of the scheduler queue of a core.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_queue_add(CCB* core, TCB* tcb)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED, &tcb->sched_node);
+	/* The caller owns the thread, so it can take new deadline parameters */
+	sched_edf_apply(tcb);
+
+	/* Deadline threads stay at the core they are admitted to */
+	if (tcb->edf.runtime != 0)
+		core = &cctx[tcb->edf.core];
+
+	/* Insert at the end of the scheduling list. The deadline list is kept
+	   sorted, with ties in FIFO order. */
+	uint q = sched_thread_queue(tcb);
+	Spin_Lock(&core->ready_lock);
+	rlnode* Q = &core->ready_queue[q];
+	rlnode* pos = Q;
+	if (q == SCHED_EDF_QUEUE)
+		for (pos = Q->next; pos != Q; pos = pos->next)
+			if (pos->tcb->edf.abs_deadline > tcb->edf.abs_deadline)
+				break;
+	rlist_push_back(pos, &tcb->sched_node);
+	tcb->queue_core = core->id;
+	core->ready_mask |= 1ull << q;
+	core->queued++;
+	Spin_Unlock(&core->ready_lock);
+
+	if (core != &CURCORE) {
+		/* The other core may be halted, or running without an alarm, or
+		   it may have to preempt its thread. The interrupt is not lost, 
+		   even if the core is just halting. */
+		cpu_ici(core->id);
+		return;
+	}
 
-	/* Restart possibly halted cores */
+	/* The current thread may be running without an alarm. Inside yield()
+	   and gain(), it is not RUNNING, and gain() arms the timer. During 
+	   boot, there is no current thread yet. */
+	TCB* current = core->current_thread;
+	if (current == NULL || current->type == IDLE_THREAD)
+		return;   /* The thread runs next here */
+
+	switch (current->state) {
+	case RUNNING:
+		if (sched_thread_preempts(tcb, current))
+			/* Preempt the current thread, as soon as interrupts are on */
+			cpu_ici(core->id);
+		else if (!core->timer_armed)
+			sched_arm_timer(core, current);
+		/* A woken thread was placed here by sched_wakeup_core(), or on 
+		   purpose by the caller; halted cores must not steal it. */
+		return;
+	case READY:
+		break;
+	default:
+		return;   /* The current thread is leaving the core */
+	}
+
+	/* In gain(), the thread we switched from waits behind the next one.
+	   Its last core is this one, so as in sched_wakeup_core(), a less
+	   loaded core is preferred: restart a halted core, to steal it. */
 	cpu_core_restart_one();
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+  The load of a core: the number of threads queued or running there.
+  This is read without locking, as a hint.
+ */
+static inline uint sched_core_load(CCB* core)
+{
+	TCB* current = core->current_thread;
+	return core->queued + (current != NULL && current->type != IDLE_THREAD);
+}
+
+/*
+  Choose the core to queue a thread that wakes up.
+
+  If the thread was woken up by the same thread as the last time, the two
+  are probably a producer/consumer pair, and the thread is queued at the
+  waker's core: it will run there when the waker blocks, and find the data
+  just produced in the caches.
+
+  Otherwise, the thread's last core probably still holds its working set
+  in its caches, so it is preferred if it is less loaded than the waker's
+  core; in particular, if it is idle. Else the thread is queued at the 
+  waker's core.
+
+  A timeout or an interrupt handler wakes a thread on behalf of no thread
+  (waker is NULL), and the thread is queued at its last core. The thread
+  that happens to run at the current core is unrelated to it.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+ */
+static CCB* sched_wakeup_core(TCB* tcb, TCB* waker)
+{
+	CCB* here = &CURCORE;
+	CCB* last = &cctx[tcb->last_core];
+
+	int pair = (waker != NULL && tcb->last_waker == waker);
+	tcb->last_waker = waker;
+
+	if (waker == NULL)
+		return last;
+
+	if (last == here || pair)
+		return here;
+
+	return (sched_core_load(last) < sched_core_load(here)) ? last : here;
+}
+
+/*
+	Adjust the state of a thread to make it READY. If 'here' is set, it is
+	queued at the current core, else at the core chosen by sched_wakeup_core()
+	for the given waker.
 
 	*** MUST BE CALLED WITH sched_spinlock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static void sched_make_ready(TCB* tcb, int here, TCB* waker)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	/* Possibly remove from TIMEOUT_WHEEL */
+	timer_cancel(&TIMEOUT_WHEEL, &tcb->wakeup_timer);
 
-	/* Mark as ready */
-	tcb->state = READY;
+	/* Mark as ready. This is paired with the lock-free check in gain() */
+	__atomic_store_n(&tcb->state, READY, __ATOMIC_RELEASE);
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+		sched_queue_add(here ? &CURCORE : sched_wakeup_core(tcb, waker), tcb);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Collect from the \c TIMEOUT_WHEEL the threads whose timeout has expired, 
+  and wake them up.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
 */
 static void sched_wakeup_expired_timeouts()
 {
 	/* Empty the timeout list up to the current time and wake up each thread */
 	TimerDuration curtime = bios_clock();
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+	/* Fast path: nothing has expired yet */
+	if (curtime < sched_next_timeout)
+		return;
+
+	Mcs_Lock(&sched_spinlock);
+
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+	timer_expire(&TIMEOUT_WHEEL, curtime, &expired);
+
+	while (!is_rlist_empty(&expired))
+		sched_make_ready(rlist_pop_front(&expired)->tcb, 0, NULL);
+
+	sched_next_timeout = timer_next(&TIMEOUT_WHEEL);
+
+	Mcs_Unlock(&sched_spinlock);
+}
+
+/*
+  Return the first non-empty list of a core's queue, or SCHED_QUEUES
+  if the queue is empty. The queue is peeked without locking.
+ */
+static inline uint sched_queue_top(CCB* core)
+{
+	uint64_t mask = __atomic_load_n(&core->ready_mask, __ATOMIC_RELAXED);
+	return (mask == 0) ? SCHED_QUEUES : (uint) __builtin_ctzll(mask);
+}
+
+/*
+  Remove a thread from the head or the tail of a list of a core's queue,
+  or return NULL if the list is empty.
+
+  *** MUST BE CALLED WITH THE CORE'S ready_lock HELD ***
+ */
+static TCB* sched_queue_pop(CCB* core, uint q, int from_back)
+{
+	rlnode* Q = &core->ready_queue[q];
+	if (is_rlist_empty(Q))
+		return NULL;
+
+	TCB* tcb = (from_back ? rlist_pop_back(Q) : rlist_pop_front(Q))->tcb;
+	if (is_rlist_empty(Q))
+		core->ready_mask &= ~(1ull << q);
+	core->queued--;
+	tcb->queue_core = -1;
+	return tcb;
+}
+
+/*
+  Remove a thread from the queue of the core that holds it, if any.
+  Return the core, or NULL if the thread was not queued. A thread that
+  was removed is owned by the caller, who must queue it again.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+ */
+static CCB* sched_queue_remove(TCB* tcb)
+{
+	while (1) {
+		int c = __atomic_load_n(&tcb->queue_core, __ATOMIC_ACQUIRE);
+		if (c < 0)
+			return NULL;
+
+		/* The thread may be popped or moved before we get the lock */
+		CCB* core = &cctx[c];
+		Spin_Lock(&core->ready_lock);
+		if (tcb->queue_core == c) {
+			/* If the list becomes empty, the next node is its head */
+			rlnode* next = tcb->sched_node.next;
+			rlist_remove(&tcb->sched_node);
+			if (is_rlist_empty(next))
+				core->ready_mask &= ~(1ull << (next - core->ready_queue));
+			core->queued--;
+			tcb->queue_core = -1;
+			Spin_Unlock(&core->ready_lock);
+			return core;
+		}
+		Spin_Unlock(&core->ready_lock);
 	}
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Return true if threads of a band as high as the current thread's are 
+  waiting in the core's queue.
+ */
+static inline int sched_queue_contends(CCB* core, TCB* current)
+{
+	uint top = sched_queue_top(core);
+	return top < SCHED_QUEUES && SCHED_QUEUE_BAND(top) <= sched_thread_band(current);
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Return true if some thread waiting in the core's queue should preempt 
+  the current thread: it is of a lower band, or both are deadline threads
+  and it has an earlier deadline.
+ */
+static int sched_queue_preempts(CCB* core, TCB* current)
+{
+	uint top_band = SCHED_QUEUE_BAND(sched_queue_top(core));
+	uint band = sched_thread_band(current);
+	if (top_band != band || band != 0)
+		return top_band < band;
+
+	Spin_Lock(&core->ready_lock);
+	rlnode* Q = &core->ready_queue[SCHED_EDF_QUEUE];
+	int ret = !is_rlist_empty(Q) 
+		&& Q->next->tcb->edf.abs_deadline < current->edf.abs_deadline;
+	Spin_Unlock(&core->ready_lock);
+	return ret;
+}
+
+/*
+  Arm the ALARM timer of the current core, if needed: for the rest of the
+  time slice of the current thread, if other threads are waiting for the
+  core or if it must not overrun its budget, and for the earliest sleep 
+  timeout, if any.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+ */
+static void sched_arm_timer(CCB* core, TCB* current)
+{
+	TimerDuration now = bios_clock();
+	TimerDuration alarm = NO_TIMEOUT;
+
+	if (!SCHED_TICKLESS
+		|| (current->type != IDLE_THREAD 
+			&& (sched_edf_active(current) || sched_queue_contends(core, current)))) {
+		TimerDuration used = now - core->slice_start;
+		alarm = (used < current->rts) ? current->rts - used : 1;
+	}
+
+	TimerDuration timeout = sched_next_timeout;
+	if (timeout != NO_TIMEOUT) {
+		timeout = (timeout > now) ? timeout - now : 1;
+		if (timeout < alarm)
+			alarm = timeout;
+	}
+
+	if (alarm != NO_TIMEOUT) {
+		bios_set_timer(alarm);
+		core->timer_armed = 1;
+	}
+}
+
+/* 
+  Interrupt handler for ALARM. In tickless mode, the alarm may be for
+  a sleep timeout, before the time slice is over.
+*/
+void yield_handler()
+{
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread;
+	core->timer_armed = 0;
+
+	if (SCHED_TICKLESS && current->type != IDLE_THREAD
+		&& bios_clock() - core->slice_start < current->rts) {
+		sched_wakeup_expired_timeouts();
+		sched_arm_timer(core, current);
+	}
+	else
+		yield(SCHED_QUANTUM);
+}
+
+/* 
+  Interrupt handler for inter-core interrupts. A thread has been queued at
+  this core. If it outranks the current thread (see sched_queue_preempts),
+  the current thread is preempted. Else, if the current thread runs without
+  an alarm, it must now be preempted at the end of its time slice. An idle 
+  core just returns from cpu_core_halt(), and goes on to yield.
+*/
+void ici_handler()
+{
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread;
+
+	if (current->state != RUNNING || current->type == IDLE_THREAD)
+		return;
+
+	if (sched_queue_preempts(core, current))
+		yield(SCHED_PREEMPT);
+	else if (!core->timer_armed && sched_queue_contends(core, current))
+		sched_arm_timer(core, current);
+}
+
+/*
+  Adjust the priority of a thread that leaves the cpu, according to
+  the cause of its yielding.
+
+  A thread that blocks on I/O or on a pipe is probably interactive, and
+  rises a level. A thread that exhausted its quantum twice in a row is 
+  CPU-bound, and drops a level. Other causes (e.g., mutex contention) 
+  do not say much about the thread, and leave its level as is.
+ */
+static void sched_adjust_priority(TCB* tcb)
+{
+	switch (tcb->curr_cause) {
+	case SCHED_QUANTUM:
+		if (tcb->last_cause == SCHED_QUANTUM && tcb->priority < PRIORITY_LEVELS - 1)
+			tcb->priority++;
+		break;
+	case SCHED_IO:
+	case SCHED_PIPE:
+		if (tcb->priority > 0)
+			tcb->priority--;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+  Periodically, raise all the threads queued at the current core to the 
+  highest level, so that CPU-bound threads are not starved by a stream of
+  interactive ones.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+ */
+static void sched_queue_boost(CCB* core, TCB* current)
+{
+	TimerDuration curtime = bios_clock();
+	if (curtime < core->last_boost + BOOST_PERIOD)
+		return;
+	core->last_boost = curtime;
+
+	current->priority = 0;
+
+	Spin_Lock(&core->ready_lock);
+	for (uint prio = 0; prio < THREAD_PRIORITIES; prio++) {
+		rlnode* Q0 = &core->ready_queue[SCHED_QUEUE(prio, 0)];
+		for (uint level = 1; level < PRIORITY_LEVELS; level++) {
+			rlnode* Q = &core->ready_queue[SCHED_QUEUE(prio, level)];
+			for (rlnode* n = Q->next; n != Q; n = n->next)
+				n->tcb->priority = 0;
+			rlist_append(Q0, Q);
+			core->ready_mask &= ~(1ull << SCHED_QUEUE(prio, level));
+		}
+		if (!is_rlist_empty(Q0))
+			core->ready_mask |= 1ull << SCHED_QUEUE(prio, 0);
+	}
+	Spin_Unlock(&core->ready_lock);
+}
+
+/*
+  A cheap pseudo-random generator (xorshift), used to pick victims
+  for stealing.
+ */
+static inline uint sched_rand(CCB* core)
+{
+	uint x = core->steal_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return core->steal_seed = x;
+}
+
+/*
+  Steal a thread from the tail of the first non-empty list of the queue 
+  of some other core. The cores are scanned starting from a random one.
+  Deadline threads are not stolen. Return NULL if all queues are empty.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+*/
+static TCB* sched_queue_steal(CCB* thief)
+{
+	uint ncores = cpu_cores();
+	uint start = sched_rand(thief) % ncores;
+
+	for (uint i = 0; i < ncores; i++) {
+		CCB* victim = &cctx[(start + i) % ncores];
+
+		/* Peek without locking, to avoid bouncing the victim's lock */
+		const uint64_t normal = ~(1ull << SCHED_EDF_QUEUE);
+		if (victim == thief || (victim->ready_mask & normal) == 0)
+			continue;
+
+		TCB* tcb = NULL;
+		Spin_Lock(&victim->ready_lock);
+		uint64_t mask = victim->ready_mask & normal;
+		if (mask != 0)
+			tcb = sched_queue_pop(victim, __builtin_ctzll(mask), 1);
+		Spin_Unlock(&victim->ready_lock);
+
+		if (tcb != NULL)
+			return tcb;
+	}
+	return NULL;
+}
+
+/*
+  Remove the head of the first non-empty list of the current core's scheduler
+  queue, and return it. If the current thread is ready and belongs to a list
+  before it (or has an earlier deadline), or if the queue is empty, the 
+  current thread is selected instead, unless it spins on a Spinlock.
+  If the current thread is not ready, a thread is stolen from another core.
+  If all else fails, the idle thread is returned.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
 */
 static TCB* sched_queue_select(TCB* current)
 {
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED);
+	CCB* core = &CURCORE;
+	TCB* next_thread = NULL;
+
+	/* The idle thread does not count as a ready thread, of course. */
+	int current_ready = (current->state == READY && current->type != IDLE_THREAD);
+
+	/* A thread spinning on a Spinlock gives the core to any other thread, 
+	   even of lower priority, since the holder of the lock may be 
+	   waiting in the queue. */
+	int current_first = current_ready && current->curr_cause != SCHED_MUTEX;
+
+	/* Get the head of the local queue. Other cores may add to it, or
+	   steal from it, behind our back; then we just miss this change. */
+	uint q = sched_queue_top(core);
+	if (current_first) {
+		uint cq = sched_thread_queue(current);
+		if (cq < q || (cq == q && q == SCHED_EDF_QUEUE && !sched_queue_preempts(core, current)))
+			q = SCHED_QUEUES;
+	}
+	if (q < SCHED_QUEUES) {
+		Spin_Lock(&core->ready_lock);
+		next_thread = sched_queue_pop(core, q, 0); /* NULL if stolen */
+		Spin_Unlock(&core->ready_lock);
+	}
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	/* Keep running the current thread, rather than steal. */
+	if (next_thread == NULL && current_ready)
+		next_thread = current;
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = sched_queue_steal(core);
 
-	next_thread->its = QUANTUM;
+	if (next_thread == NULL)
+		next_thread = &core->idle_thread;
+
+	/* A deadline thread runs until its budget is exhausted */
+	next_thread->its = sched_edf_active(next_thread) 
+		? next_thread->edf.budget : LEVEL_QUANTUM(next_thread->priority);
 
 	return next_thread;
 }
@@ -342,7 +1113,7 @@ static TCB* sched_queue_select(TCB* current)
 /*
   Make the process ready.
  */
-int wakeup(TCB* tcb)
+static int sched_wakeup(TCB* tcb, int here, TCB* waker)
 {
 	int ret = 0;
 
@@ -350,14 +1121,14 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	Mcs_Lock(&sched_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		sched_make_ready(tcb, here, waker);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mcs_Unlock(&sched_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -366,18 +1137,229 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup(TCB* tcb)
+{
+	return sched_wakeup(tcb, 0, cur_thread());
+}
+
+int wakeup_here(TCB* tcb)
+{
+	return sched_wakeup(tcb, 1, cur_thread());
+}
+
+uint wakeup_batch(TCB* tcbs[], int woken[], uint n, TCB* waker)
+{
+	uint ret = 0;
+	int oldpre = preempt_off;
+	Mcs_Lock(&sched_spinlock);
+
+	for (uint i = 0; i < n; i++) {
+		TCB* tcb = tcbs[i];
+		woken[i] = (tcb->state == STOPPED || tcb->state == INIT);
+		if (woken[i]) {
+			sched_make_ready(tcb, 0, waker);
+			ret++;
+		}
+	}
+
+	Mcs_Unlock(&sched_spinlock);
+	if (oldpre)
+		preempt_on;
+	return ret;
+}
+
+void set_thread_priority(TCB* tcb, uint priority)
+{
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	/* A queued thread moves to the list of its new priority. If it now
+	   outranks the current thread of its core, sched_queue_add()
+	   preempts it. */
+	CCB* qcore = sched_queue_remove(tcb);
+	__atomic_store_n(&tcb->static_priority, priority, __ATOMIC_RELAXED);
+	if (qcore != NULL)
+		sched_queue_add(qcore, tcb);
+
+	/* A running thread that lowers its priority may now be outranked.
+	   At another core, the ICI handler checks. */
+	if (tcb == core->current_thread) {
+		if (sched_queue_preempts(core, tcb))
+			cpu_ici(core->id);
+	}
+	else if (tcb->state == RUNNING)
+		cpu_ici(tcb->last_core);
+
+	if (preempt)
+		preempt_on;
+}
+
+/* The lock of admission control; it protects the edf_util of all cores */
+static Spinlock edf_lock = SPINLOCK_INIT;
+
+/* The utilization of a deadline thread, in ppm, rounded up */
+static inline uint edf_utilization(TimerDuration runtime, TimerDuration period)
+{
+	return (uint) ((runtime * 1000000 + period - 1) / period);
+}
+
+/*
+  Apply the parameters last admitted for a thread, if they changed. The
+  caller must own the thread: it is the current thread, or it is not in
+  any queue and no other core can run it.
+  Return 1 if the parameters changed.
+
+  *** MUST BE CALLED IN THE NON-PREEMPTIVE DOMAIN ***
+ */
+static int sched_edf_apply(TCB* tcb)
+{
+	if (!__atomic_load_n(&tcb->edf_changed, __ATOMIC_ACQUIRE))
+		return 0;
+
+	Spin_Lock(&edf_lock);
+	edf_params* E = &tcb->edf;
+	edf_params* A = &tcb->edf_admitted;
+	if (E->runtime == 0 && A->runtime != 0)
+		E->jobs = E->misses = 0;
+	E->runtime = A->runtime;
+	E->period = A->period;
+	E->deadline = A->deadline;
+	E->release = A->release;
+	E->abs_deadline = A->abs_deadline;
+	E->budget = A->runtime;
+	E->core = A->core;
+	tcb->edf_changed = 0;
+	Spin_Unlock(&edf_lock);
+	return 1;
+}
+
+/*
+  Admission control works on edf_admitted, under edf_lock. The parameters
+  in effect (edf) are only changed by the owner of the thread, since the 
+  core that runs it charges its budget without locking. If the thread is
+  queued, it is taken out of its queue, and is queued again with the new
+  parameters, possibly at another core.
+ */
+int sched_edf_admit(TCB* tcb, TimerDuration runtime, TimerDuration period, 
+	TimerDuration deadline)
+{
+	edf_params* A = &tcb->edf_admitted;
+	int ret = 0;
+
+	int preempt = preempt_off;
+	Spin_Lock(&edf_lock);
+
+	/* Withdraw the current reservation, if any */
+	uint old_util = (A->runtime != 0) ? edf_utilization(A->runtime, A->period) : 0;
+	cctx[A->core].edf_util -= old_util;
+
+	if (runtime == 0) {
+		A->runtime = 0;
+		goto changed;
+	}
+
+	/* Pick the least loaded core that can take the thread (worst fit), 
+	   so that every core keeps some slack */
+	uint util = edf_utilization(runtime, period);
+	CCB* best = NULL;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* core = &cctx[c];
+		if (core->edf_util + util <= EDF_CAPACITY 
+			&& (best == NULL || core->edf_util < best->edf_util))
+			best = core;
+	}
+
+	if (best == NULL) {
+		cctx[A->core].edf_util += old_util;
+		ret = -1;
+		Spin_Unlock(&edf_lock);
+		goto done;
+	}
+
+	best->edf_util += util;
+
+	TimerDuration now = bios_clock();
+	A->runtime = runtime;
+	A->period = period;
+	A->deadline = deadline;
+	A->release = now;
+	A->abs_deadline = now + deadline;
+	A->core = best->id;
+
+changed:
+	__atomic_store_n(&tcb->edf_changed, 1, __ATOMIC_RELEASE);
+	Spin_Unlock(&edf_lock);
+
+	/* Apply at once, if we can own the thread; else, its owner applies
+	   them when it queues or runs it. An exited thread is owned by the 
+	   core that releases it. */
+	if (tcb == CURTHREAD || tcb->state == EXITED)
+		sched_edf_apply(tcb);
+	else {
+		CCB* core = sched_queue_remove(tcb);
+		if (core != NULL)
+			sched_queue_add(core, tcb);
+	}
+
+done:
+	if (preempt)
+		preempt_on;
+	return ret;
+}
+
+TimerDuration sched_edf_end_job(TCB* tcb)
+{
+	edf_params* E = &tcb->edf;
+
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+	assert(tcb == core->current_thread);
+
+	TimerDuration now = bios_clock();
+	E->jobs++;
+	if (now > E->abs_deadline) {
+		E->misses++;
+		__atomic_add_fetch(&cctx[E->core].edf_misses, 1, __ATOMIC_RELAXED);
+	}
+
+	/* Set up the next job. A job released late gets its full window. */
+	E->release += E->period;
+	if (E->release < now)
+		E->release = now;
+	E->abs_deadline = E->release + E->deadline;
+	E->budget = E->runtime;
+
+	/* Do not charge the time of the finished job to the new budget */
+	core->slice_start = now;
+
+	if (preempt)
+		preempt_on;
+	return E->release - now;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+void sleep_releasing(Thread_state state, McsLock* mx, enum SCHED_CAUSE cause,
 	TimerDuration timeout)
+{
+	sleep_releasing_waking(state, mx, NULL, cause, timeout);
+}
+
+/*
+  The thread to wake up is made ready after the current thread has
+  stopped running, so that sched_queue_add() does not arm the timer to
+  end the slice of the current thread.
+ */
+void sleep_releasing_waking(Thread_state state, McsLock* mx, TCB* wake,
+	enum SCHED_CAUSE cause, TimerDuration timeout)
 {
 	assert(state == STOPPED || state == EXITED);
 
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mcs_Lock(&sched_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -386,12 +1368,16 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
+	/* wake up the successor at this core */
+	if (wake != NULL && (wake->state == STOPPED || wake->state == INIT))
+		sched_make_ready(wake, 1, tcb);
+
 	/* Release mx */
 	if (mx != NULL)
-		Mutex_Unlock(mx);
+		Mcs_Unlock(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	Mcs_Unlock(&sched_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -405,17 +1391,26 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 void yield(enum SCHED_CAUSE cause)
 {
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
-
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
+	CCB* core = &CURCORE;
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	/* Reset the timer, so that we are not interrupted by ALARM */
+	if (core->timer_armed) {
+		bios_cancel_timer();
+		core->timer_armed = 0;
+	}
+	TimerDuration used = bios_clock() - core->slice_start;
+	TimerDuration remaining = (used < current->rts) ? current->rts - used : 0;
+
+	/* Charge the budget of a deadline thread */
+	if (sched_edf_active(current))
+		current->edf.budget = (used < current->edf.budget) ? current->edf.budget - used : 0;
 
-	/* Update CURTHREAD state */
+	/* Update CURTHREAD state. A RUNNING thread is not touched by other 
+	   cores, so this needs no locking. */
 	if (current->state == RUNNING)
 		current->state = READY;
 
@@ -424,6 +1419,11 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
+	/* Apply the feedback, and age the threads of this core */
+	if (current->type != IDLE_THREAD) 
+		sched_adjust_priority(current);
+	sched_queue_boost(core, current);
+
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
@@ -432,12 +1432,11 @@ void yield(enum SCHED_CAUSE cause)
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
+	core->previous_thread = current;
 
 	/* Switch contexts */
 	if (current != next) {
+		__atomic_store_n(&core->switches, core->switches + 1, __ATOMIC_RELEASE);
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -462,42 +1461,60 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
-	TCB* current = CURTHREAD;
-
-	/* Mark current state */
-	current->state = RUNNING;
-	current->phase = CTX_DIRTY;
-	current->rts = current->its;
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
 	if (current != prev) {
-		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		switch (__atomic_load_n(&prev->state, __ATOMIC_ACQUIRE)) {
 		case READY:
+			prev->phase = CTX_CLEAN;
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(core, prev);
 			break;
 		case EXITED:
+			prev->phase = CTX_CLEAN;
 			release_TCB(prev);
 			break;
 		case STOPPED:
+			/* We may race with a wakeup(), which will not queue a 
+			   CTX_DIRTY thread. */
+			Mcs_Lock(&sched_spinlock);
+			prev->phase = CTX_CLEAN;
+			if (prev->state == READY)
+				sched_queue_add(core, prev);
+			Mcs_Unlock(&sched_spinlock);
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* New deadline parameters change the time slice */
+	if (sched_edf_apply(current))
+		current->its = sched_edf_active(current) 
+			? current->edf.budget : LEVEL_QUANTUM(current->priority);
+
+	/* Mark current state. The current thread is READY, and no other core
+	   touches READY threads that are not in a queue. */
+	current->state = RUNNING;
+	current->phase = CTX_DIRTY;
+	current->rts = current->its;
+
+	/* Count the migration, if the thread last ran elsewhere */
+	if (current->last_core != core->id) {
+		core->migrations++;
+		current->last_core = core->id;
+	}
+
+	/* Start the time slice, and set an alarm if needed */
+	core->slice_start = bios_clock();
+	sched_arm_timer(core, current);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -507,7 +1524,15 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* gain() may have just queued the thread we switched from. Also,
+		   an interrupt may queue a thread after the check, and the core 
+		   may have no alarm to restart it; so check with interrupts off 
+		   (cpu_core_halt() turns them back on). */
+		preempt_off;
+		if (sched_queue_top(&CURCORE) == SCHED_QUEUES)
+			cpu_core_halt();
+		else
+			preempt_on;
 		yield(SCHED_IDLE);
 	}
 
@@ -521,8 +1546,45 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
-	rlnode_init(&SCHED, NULL);
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	/* The core queues must be ready before any core enters the scheduler,
+	   since the init task is woken up during boot. */
+	for (uint c = 0; c < MAX_CORES; c++) {
+		for (uint q = 0; q < SCHED_QUEUES; q++)
+			rlnode_init(&cctx[c].ready_queue[q], NULL);
+		cctx[c].ready_mask = 0;
+		cctx[c].ready_lock = SPINLOCK_INIT;
+		cctx[c].steal_seed = 2654435761u * (c + 1);
+		cctx[c].last_boost = 0;
+		cctx[c].current_thread = NULL;
+		cctx[c].timer_armed = 0;
+		cctx[c].slice_start = 0;
+		cctx[c].queued = 0;
+		cctx[c].migrations = 0;
+		cctx[c].edf_util = 0;
+		cctx[c].edf_misses = 0;
+	}
+
+	timer_wheel_init(&TIMEOUT_WHEEL, bios_clock());
+	sched_next_timeout = NO_TIMEOUT;
+
+	for (uint c = 0; c < MAX_CORES; c++)
+		thread_mag[c] = (thread_magazine) { .count = 0 };
+	rlnode_init(&thread_depot, NULL);
+	thread_depot_count = 0;
+	for (uint c = 0; c < THREAD_STACK_CLASSES; c++)
+		rlnode_init(&thread_free_list[c], NULL);
+}
+
+void finalize_scheduler()
+{
+#if defined(SCHED_STATISTICS)
+	for (uint c = 0; c < cpu_cores(); c++)
+		fprintf(stderr, "Core %3u: migrations=%lu deadline misses=%lu\n", 
+			c, cctx[c].migrations, cctx[c].edf_misses);
+#endif
+
+	thread_cache_drain();
+	thread_arena_release();
 }
 
 void run_scheduler()
@@ -538,14 +1600,23 @@ void run_scheduler()
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
-	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	timer_node_init(&curcore->idle_thread.wakeup_timer, &curcore->idle_thread);
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
+	curcore->idle_thread.priority = 0;
+	curcore->idle_thread.static_priority = PRIORITY_LOWEST;
+	curcore->idle_thread.edf = (edf_params) { .runtime = 0 };
+	curcore->idle_thread.edf_admitted = curcore->idle_thread.edf;
+	curcore->idle_thread.edf_changed = 0;
+	curcore->idle_thread.queue_core = -1;
+	curcore->idle_thread.last_core = cpu_core_id;
+	curcore->idle_thread.last_waker = NULL;
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+	curcore->idle_thread.wchan = NULL;
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
@@ -23,6 +23,7 @@
 #include "bios.h"
 #include "tinyos.h"
 #include "util.h"
+#include "kernel_timer.h"
 
 
 /*****************************
@@ -85,13 +86,39 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Spin_Lock yielded on contention, or @c Mutex_Lock slept */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
+	SCHED_PREEMPT, /**< @brief A thread of higher static priority became ready */
 	SCHED_USER /**< @brief User-space code called yield */
 };
 
+/**
+  @brief The parameters and the state of a thread in the deadline class.
+
+  A thread in the deadline class runs a sequence of jobs. A job is released
+  every @c period; it needs @c runtime of cpu time, and must complete by
+  @c deadline after its release. All times are in microseconds.
+
+  While the current job has budget left, the thread is scheduled by 
+  earliest deadline first, ahead of all other threads. A thread that runs 
+  out of budget is scheduled as a normal thread, until its next job.
+ */
+typedef struct edf_params {
+	TimerDuration runtime;   /**< @brief The cpu time of a job; 0 if not in the deadline class */
+	TimerDuration period;    /**< @brief The period between job releases */
+	TimerDuration deadline;  /**< @brief The deadline of a job, relative to its release */
+
+	TimerDuration release;      /**< @brief The release time of the current job */
+	TimerDuration abs_deadline; /**< @brief The absolute deadline of the current job */
+	TimerDuration budget;       /**< @brief The cpu time left to the current job */
+
+	uint core;              /**< @brief The core the thread is admitted to */
+	unsigned long jobs;     /**< @brief The number of completed jobs */
+	unsigned long misses;   /**< @brief The number of jobs that completed after their deadline */
+} edf_params;
+
 /**
   @brief The thread control block
 
@@ -108,16 +135,32 @@ typedef struct thread_control_block {
 	Thread_phase phase; /**< @brief The phase of the thread */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+	size_t stack_size; /**< @brief The size of the thread's stack */
 
-	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	timer_node wakeup_timer; /**< @brief Node in the scheduler's timer wheel, holding the time this thread will be woken up */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
+	uint priority; /**< @brief The feedback queue level of the thread, 0 is the highest */
+	uint static_priority; /**< @brief The static priority of the thread, 0 is the highest */
+	edf_params edf; /**< @brief The parameters of the deadline class, if the thread is in it */
+	edf_params edf_admitted; /**< @brief The parameters last admitted by @c sched_edf_admit(); only @c runtime, @c period, @c deadline, @c release, @c abs_deadline and @c core are used */
+	int edf_changed; /**< @brief Set if @c edf_admitted has not been applied to @c edf yet */
+	int queue_core; /**< @brief The core whose queue holds the thread, or -1 if it is not queued */
+	uint last_core; /**< @brief The core the thread last ran on */
+	struct thread_control_block* last_waker; /**< @brief The thread that last woke this thread up (only compared, never dereferenced) */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
 
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	const char* wchan; /**< @brief The wait channel the thread sleeps on, or NULL.
+
+	  This is the name of the kernel function that put the thread to sleep. */
+#if defined(WCHAN_PROFILING)
+	unsigned long wchan_since; /**< @brief The host time the thread went to sleep, in nsec */
+#endif
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -131,12 +174,73 @@ typedef struct thread_control_block {
 
 } TCB;
 
+/** @brief The number of priority levels of the scheduler.
+
+  Threads start at level 0 (the highest). A thread that exhausts its 
+  quantum twice in a row drops one level, and a thread that blocks on 
+  I/O or on a pipe rises one level.
+ */
+#define PRIORITY_LEVELS 4
+
+/** @brief The number of static thread priorities.
+
+  The static priority of a thread is set by the user (see @c SetPriority).
+  A thread is never scheduled while a thread of a higher static priority 
+  is ready at the same core.
+ */
+#define THREAD_PRIORITIES (PRIORITY_LOWEST + 1)
+
+/** @brief The list of a core's queue for threads of the deadline class.
+
+  This list is sorted by absolute deadline.
+ */
+#define SCHED_EDF_QUEUE 0
+
+/** @brief The number of lists in a core's scheduler queue. */
+#define SCHED_QUEUES (1 + THREAD_PRIORITIES * PRIORITY_LEVELS)
+
+/** @brief The list of a core's queue for a static priority and a level. */
+#define SCHED_QUEUE(static_prio, level) (1 + (static_prio) * PRIORITY_LEVELS + (level))
+
+/** @brief The band of a list of a core's queue.
+
+  The band is 0 for the deadline class, and 1 plus the static priority for
+  the other lists. Threads of a lower band preempt threads of a higher band.
+  For @c SCHED_QUEUES, the band is higher than that of any list.
+ */
+#define SCHED_QUEUE_BAND(q) (((q) + PRIORITY_LEVELS - 1) / PRIORITY_LEVELS)
+
+/** @brief The fraction of a core's time available to the deadline class, in ppm. */
+#define EDF_CAPACITY 900000
+
+/** @brief Return true if a thread is scheduled in the deadline class. */
+static inline int sched_edf_active(TCB* tcb)
+{
+	return tcb->edf.runtime != 0 && tcb->edf.budget != 0;
+}
+
+/** @brief Return the band of a thread (see @c SCHED_QUEUE_BAND). */
+static inline uint sched_thread_band(TCB* tcb)
+{
+	return sched_edf_active(tcb) ? 0 : 1 + tcb->static_priority;
+}
+
 /** @brief Thread stack size.
 
   The default thread stack size in TinyOS is 128 kbytes.
+  Stack memory is committed lazily, as the stack is touched.
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The smallest thread stack size.
+
+  Stack sizes are rounded up to a power of 2 times this size.
+ */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The largest thread stack size. Larger requests are capped. */
+#define THREAD_STACK_MAX (THREAD_STACK_MIN << 9)
+
 /************************
  *
  *      Scheduler
@@ -146,19 +250,62 @@ typedef struct thread_control_block {
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a multilevel feedback queue of @c READY threads for each
+  static priority, one list per priority level, and a list of threads of
+  the deadline class, sorted by deadline. A core always picks its next thread from its own queue,
+  and only when this queue is empty it tries to steal a thread from the queue 
+  of some other core. A thread that wakes up is queued at the core it last
+  ran on, or at the core of the thread that woke it.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
 
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
+	uint switches; /**< @brief Incremented before @c current_thread changes; @see cur_thread() */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	rlnode ready_queue[SCHED_QUEUES]; /**< @brief The queues of @c READY threads owned by this core, per static priority and level */
+	uint64_t ready_mask; /**< @brief Bit @c q is set iff @c ready_queue[q] is not empty */
+	uint edf_util; /**< @brief The utilization of the deadline threads admitted here, in ppm */
+	Spinlock ready_lock; /**< @brief Spinlock protecting @c ready_queue */
+	uint steal_seed; /**< @brief Random state for choosing a victim to steal from */
+	TimerDuration last_boost; /**< @brief The last time the queued threads were aged */
+
+	int timer_armed; /**< @brief True if the core's ALARM timer is armed */
+	TimerDuration slice_start; /**< @brief The time the current time slice started */
+
+	uint queued; /**< @brief The number of threads in @c ready_queue */
+	unsigned long migrations; /**< @brief The number of times a thread came to run here from another core */
+	unsigned long edf_misses; /**< @brief The number of deadline misses of the threads admitted here */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
+/**
+  @brief Return true if the current thread should be preempted.
+
+  This is true when a thread of higher static priority is ready at the
+  current core. Normally, such a thread preempts the current thread at
+  once, but it may have found a @c Spinlock locked by the current thread,
+  and yielded. The check is done without locking.
+
+  @see Spin_Unlock
+ */
+static inline int sched_preempt_pending()
+{
+	CCB* core = &cctx[cpu_core_id];
+	TCB* current = core->current_thread;
+	uint64_t mask = __atomic_load_n(&core->ready_mask, __ATOMIC_RELAXED);
+
+	return mask != 0 && current != NULL 
+		&& current->state == RUNNING && current->type != IDLE_THREAD
+		&& SCHED_QUEUE_BAND((uint) __builtin_ctzll(mask)) < sched_thread_band(current);
+}
+
 
 /** 
   @brief The current thread.
@@ -166,8 +313,10 @@ extern CCB cctx[MAX_CORES];
   This function returns the TCB of the calling thread. Via this function,
   a system call can identify the process executing it, and all other information.
 
-  For performance reasons, it is advised to call this function
-  only once in each system call.
+  This call does not turn preemption off; it reads the current thread
+  of the core lock-free, and retries if the caller was switched out
+  meanwhile. Still, for performance reasons, it is advised to call this
+  function only once in each system call.
 
   @returns a pointer to the TCB of the caller.
 */
@@ -199,15 +348,20 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The stack size of the new thread. It is rounded up
+                to a size class, and capped at @c THREAD_STACK_MAX. If 0,
+                the size is @c THREAD_STACK_SIZE.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb,void (*func)());
+TCB* spawn_thread(PCB* pcb,void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
 
   This call will change the state of a thread from @c STOPPED or @c INIT (where the
-  thread is blocked) to @c READY. 
+  thread is blocked) to @c READY. The thread is queued at its last core or
+  at the current core, depending on the load of the two and on whether
+  the current thread also woke it up the last time.
 
   @param tcb the thread to be made @c READY.
   @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
@@ -215,6 +369,85 @@ TCB* spawn_thread(PCB* pcb,void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread at the current core.
+
+  This is like @c wakeup(), but the thread is queued at the current core,
+  wherever it last ran. It suits a thread woken up to take over something
+  that the current thread has just released: it will run as soon as the
+  current thread blocks, without the cost of restarting another core.
+  Idle cores may still steal it.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+ */
+int wakeup_here(TCB* tcb);
+
+/**
+  @brief Wakeup a batch of blocked threads.
+
+  This is like calling @c wakeup() on each thread, but the scheduler lock
+  is taken only once for the whole batch. The threads are woken up on
+  behalf of @c waker, which chooses the core each one is queued at (see
+  @c wakeup()); an interrupt handler passes NULL.
+
+  @param tcbs the threads to be made @c READY
+  @param woken for each thread, set to 1 if it was woken up, else to 0
+  @param n the number of threads
+  @param waker the thread that wakes them up, or NULL
+  @returns the number of threads woken up
+ */
+uint wakeup_batch(TCB* tcbs[], int woken[], uint n, TCB* waker);
+
+/**
+  @brief Set the static priority of a thread.
+
+  The new priority takes effect at once: a queued thread moves to the list
+  of its new priority, and preempts the current thread of its core, if it
+  now outranks it. A running thread that lowers its priority below that
+  of a queued thread is preempted.
+
+  @param tcb the thread
+  @param priority the new static priority, between @c PRIORITY_HIGHEST
+     and @c PRIORITY_LOWEST
+ */
+void set_thread_priority(TCB* tcb, uint priority);
+
+/**
+  @brief Move a thread into, or out of, the deadline class.
+
+  Admission control assigns the thread to a core, whose deadline threads
+  must not use more than @c EDF_CAPACITY of its time, counting 
+  @c runtime/period for each thread. The thread's first job is released 
+  at once. If @c runtime is 0, the thread leaves the deadline class.
+
+  The new parameters take effect at once, if the thread is the current
+  thread or is queued (a queued thread is requeued, at the core it is
+  admitted to); else, the next time the thread is queued or runs.
+
+  @param tcb the thread
+  @param runtime the cpu time of each job, in microseconds
+  @param period the period of the jobs, in microseconds
+  @param deadline the deadline of each job, relative to its release
+  @returns 0 on success, or -1 if the thread cannot be admitted; then,
+     its parameters are not changed
+ */
+int sched_edf_admit(TCB* tcb, TimerDuration runtime, TimerDuration period, 
+	TimerDuration deadline);
+
+/**
+  @brief Complete the current job of a thread in the deadline class.
+
+  The job is counted, and counted as missed if it is past its deadline.
+  The next job is set up; it is released one period after the current
+  one, or now, if that time has passed.
+
+  @param tcb the current thread
+  @returns the time until the release of the next job; the thread 
+     should sleep for this long
+ */
+TimerDuration sched_edf_end_job(TCB* tcb);
+
 /** 
   @brief Block the current thread.
 
@@ -241,11 +474,30 @@ int wakeup(TCB* tcb);
 	@c wakeup() by another thread.
 
 	@param newstate the new state for the current thread, which must be either stopped or exited
-	@param mx the mutex to unlock.
+	@param mx the queue spinlock to unlock, or NULL. It must have been locked
+	          in the non-preemptive domain.
 	@param cause the cause of the sleep
 	@param timeout a timeout for the sleep, or 
    */
-void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+void sleep_releasing(Thread_state newstate, McsLock* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+
+/**
+  @brief Block the current thread, waking up another thread.
+
+  This is like @c sleep_releasing(), but thread @c wake, if not NULL and
+  blocked, is also made @c READY at the current core, atomically with
+  the blocking of the current thread. It suits a thread that hands a
+  resource over to another thread just before it sleeps: the woken thread
+  takes over the core, without ending the time slice of the current one.
+
+  @param newstate the new state for the current thread
+  @param mx the queue spinlock to unlock, or NULL
+  @param wake the thread to wake up, or NULL
+  @param cause the cause of the sleep
+  @param timeout a timeout for the sleep, or @c NO_TIMEOUT
+ */
+void sleep_releasing_waking(Thread_state newstate, McsLock* mx, TCB* wake,
+	enum SCHED_CAUSE cause, TimerDuration timeout);
 
 /**
   @brief Give up the CPU.
@@ -272,6 +524,14 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+   This function is called after the scheduler has stopped on all cores,
+   to release the resources held by the scheduler.
+ */
+void finalize_scheduler(void);
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -279,6 +539,22 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief The quantum (in microseconds) of a priority level.
+
+  Lower levels hold CPU-bound threads, which get longer time-slices and
+  therefore fewer context switches.
+ */
+#define LEVEL_QUANTUM(level) (QUANTUM << (level))
+
+/**
+  @brief Aging period (in microseconds)
+
+  Every so often, each core moves all threads in its queue to the highest
+  level, so that CPU-bound threads do not starve.
+  */
+#define BOOST_PERIOD (50*QUANTUM)
+
 /** @} */
 
 #endif
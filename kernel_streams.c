@@ -11,6 +11,9 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects FCB_freelist */
+static Spinlock fcb_lock = SPINLOCK_INIT;
+
 
 void initialize_files()
 {
@@ -26,33 +29,39 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+
+  Spin_Lock(&fcb_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;   /* Not ready yet, see get_fcb() */
   }
-  else
-    return NULL;
+  Spin_Unlock(&fcb_lock);
+
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Spin_Lock(&fcb_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Spin_Unlock(&fcb_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    int retval = fcb->streamfunc ? fcb->streamfunc->Close(fcb->streamobj) : 0;
     release_FCB(fcb);
     return retval;
   }
@@ -67,6 +76,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
+    int ok = 0;
+
+    Mutex_Lock(&cur->lock);
 
     /* Find distinct fids */
     for(i=0; i<num; i++) {
@@ -75,7 +87,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +98,18 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
-    return 1;
+    ok = 1;
+
+finish:
+    Mutex_Unlock(&cur->lock);
+    return ok;
 }
 
 
@@ -101,11 +117,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->lock);
 }
 
 
@@ -120,41 +138,56 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
  */
 
 
-FCB* get_fcb(Fid_t fid)
+/*
+  Look up an fid in the file table of a process. A reserved FCB is 
+  not visible until its stream is set.
+ */
+static inline FCB* fidt_lookup(PCB* pcb, Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  FCB* fcb = pcb->FIDT[fid];
+  return (fcb != NULL && fcb->streamfunc != NULL) ? fcb : NULL;
+}
+
+
+FCB* get_fcb(Fid_t fid)
+{
+  return fidt_lookup(CURPROC, fid);
+}
+
+
+FCB* get_fcb_ref(Fid_t fid)
+{
+  PCB* cur = CURPROC;
+
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = fidt_lookup(cur, fid);
+  if(fcb)
+    FCB_incref(fcb);
+  Mutex_Unlock(&cur->lock);
+
+  return fcb;
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
+    int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
   
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = devread(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,32 +196,21 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
 
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = devwrite(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
-
   }
 
-
   return retcode;
 }
 
@@ -196,13 +218,17 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  PCB* cur = CURPROC;
 
-  FCB* fcb = get_fcb(fd);
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = fidt_lookup(cur, fd);
+  if(fcb)
+    cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  /* The stream is closed without holding the lock */
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,18 +247,28 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+
+  FCB* old = fidt_lookup(cur, oldfd);
+  FCB* new = fidt_lookup(cur, newfd);
 
   if(old==NULL) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+
+  Mutex_Unlock(&cur->lock);
+
+  /* The replaced stream is closed without holding the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -257,10 +293,19 @@ Fid_t open_stream(Device_type major, unsigned int minor)
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  void* sobj;
+  file_ops* sfunc;
+  if(device_open(major, minor, &sobj, &sfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+
+  /* Make the stream visible */
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->lock);
+  fcb->streamobj = sobj;
+  fcb->streamfunc = sfunc;
+  Mutex_Unlock(& cur->lock);
   
   goto finok;
 finerr:
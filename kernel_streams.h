@@ -20,9 +20,15 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
+	of this file to access FCBs: @ref get_fcb_ref, @ref FCB_reserve
 	and @ref FCB_unreserve.
 
+	The file table of a process is protected by the @c lock of its 
+	PCB. The reference count of an FCB is updated atomically, so
+	that a stream can be used without holding any lock; a thread 
+	that uses a stream holds a reference to it, so that the stream
+	is not closed under its feet.
+
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
 	for read, write and close.
@@ -40,7 +46,7 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
   rlnode freelist_node;		/**< @brief Intrusive list node */
@@ -121,6 +127,7 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	It must be called with the @c lock of the current PCB held.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -128,6 +135,18 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, and acquire a reference to it.
+
+	This routine will return NULL if the fid is not legal. Else,
+	the reference count of the FCB is increased, and the caller
+	must call @ref FCB_decref when done with the FCB.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
@@ -12,33 +12,23 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
-
-
-#define POST_CALL \
-kernel_unlock();\
-
+/*
+	There is no global kernel lock; each system call locks the
+	kernel objects it uses.
+ */
 
 /* with return */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET NAME SIG \
 {\
-	RET __ret;\
-	PRE_CALL\
-	__ret = sys_##NAME ARGS;\
-	POST_CALL\
-	return __ret;\
+	return sys_##NAME ARGS;\
 }\
 
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
-	PRE_CALL\
 	sys_##NAME ARGS;\
-	POST_CALL\
 }\
 
 
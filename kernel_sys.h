@@ -11,7 +11,16 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, size_t stack_size), (task, argl, args, stack_size))\
+SYSCALL(CreateThreadPriority, Tid_t, (Task task, int argl, void* args, int priority), (task, argl, args, priority))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL(SetPriority, int, (Tid_t tid, int priority), (tid, priority))\
+SYSCALL(GetPriority, int, (Tid_t tid), (tid))\
+SYSCALL(SetDeadline, int, (Tid_t tid, unsigned long runtime, unsigned long period, unsigned long deadline), (tid, runtime, period, deadline))\
+SYSCALL(WaitPeriod, int, (void), ())\
+SYSCALL(GetDeadline, int, (Tid_t tid, deadline_info* info), (tid, info))\
+SYSCALL(WaitOnAddress, int, (int* addr, int expected, timeout_t timeout), (addr, expected, timeout))\
+SYSCALL(WakeAddress, int, (int* addr, unsigned int n), (addr, n))\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
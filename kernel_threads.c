@@ -5,12 +5,14 @@
 #include "util.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_sys.h"
 
 
-/** 
-  @brief Create a new thread in the current process.
-  */
-Tid_t sys_CreateThread(Task task, int argl, void* args)
+/*
+  Create a new thread in the current process, with the given stack size
+  (0 for the default) and static priority (-1 to inherit the caller's).
+ */
+static Tid_t create_thread(Task task, int argl, void* args, size_t stack_size, int priority)
 {
   /*acquire new ptcb */
   PTCB* ptcb = acquire_PTCB();
@@ -19,15 +21,21 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
   /* create new thread */
   
-  ptcb->tcb = spawn_thread(CURPROC, start_multiThread);
+  ptcb->tcb = spawn_thread(CURPROC, start_multiThread, stack_size);
   TCB* newtcb = ptcb->tcb;
 
-  CURPROC->thread_count++;
+  if(priority >= 0)
+    newtcb->static_priority = priority;
+  ptcb->priority = newtcb->static_priority;
+
   newtcb->owner_ptcb = ptcb;
   assert(CURPROC != NULL && ptcb != NULL && newtcb != NULL);
  /* newtcb->owner_ptcb = ptcb;*/
   /*put the new ptcb in the list of the CURPROC*/
+  Mutex_Lock(&CURPROC->lock);
+  CURPROC->thread_count++;
   rlist_push_back(&CURPROC->PTCB_list,&ptcb->PTCB_node);
+  Mutex_Unlock(&CURPROC->lock);
 
   /*wake up the new tcb*/
   wakeup(newtcb);
@@ -35,6 +43,33 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 	return(Tid_t)ptcb;
 }
 
+/** 
+  @brief Create a new thread in the current process.
+  */
+Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return create_thread(task, argl, args, 0, -1);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a stack size hint.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, size_t stack_size)
+{
+  return create_thread(task, argl, args, stack_size, -1);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a static priority.
+  */
+Tid_t sys_CreateThreadPriority(Task task, int argl, void* args, int priority)
+{
+  if(priority < PRIORITY_HIGHEST || priority > PRIORITY_LOWEST)
+    return NOTHREAD;
+
+  return create_thread(task, argl, args, 0, priority);
+}
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -44,6 +79,122 @@ Tid_t sys_ThreadSelf()
 	return (Tid_t) (cur_thread()->owner_ptcb);
 }
 
+/**
+  @brief Set the static priority of the given thread.
+  Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - the priority is out of range.
+  */
+int sys_SetPriority(Tid_t tid, int priority)
+{
+  PTCB *ptcb = (PTCB *)tid;
+  int ret = -1;
+
+  Mutex_Lock(&CURPROC->lock);
+
+  if(tid == NOTHREAD || rlist_find(&CURPROC->PTCB_list, ptcb, NULL) == NULL)
+    goto finish;
+
+  if(ptcb->exited || priority < PRIORITY_HIGHEST || priority > PRIORITY_LOWEST)
+    goto finish;
+
+  ptcb->priority = priority;
+  set_thread_priority(ptcb->tcb, priority);
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&CURPROC->lock);
+  return ret;
+}
+
+/**
+  @brief Return the static priority of the given thread.
+  */
+int sys_GetPriority(Tid_t tid)
+{
+  PTCB *ptcb = (PTCB *)tid;
+  int ret = -1;
+
+  Mutex_Lock(&CURPROC->lock);
+  if(tid != NOTHREAD && rlist_find(&CURPROC->PTCB_list, ptcb, NULL) != NULL)
+    ret = ptcb->priority;
+  Mutex_Unlock(&CURPROC->lock);
+
+  return ret;
+}
+
+/**
+  @brief Put the given thread in the deadline class, or take it out.
+  Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - the parameters are illegal.
+    - admission control rejects the thread.
+  */
+int sys_SetDeadline(Tid_t tid, unsigned long runtime, unsigned long period, unsigned long deadline)
+{
+  PTCB *ptcb = (PTCB *)tid;
+  int ret = -1;
+
+  if(runtime != 0 && !(runtime <= deadline && deadline <= period))
+    return -1;
+
+  Mutex_Lock(&CURPROC->lock);
+  if(tid != NOTHREAD && rlist_find(&CURPROC->PTCB_list, ptcb, NULL) != NULL && !ptcb->exited)
+    ret = sched_edf_admit(ptcb->tcb, runtime, period, deadline);
+  Mutex_Unlock(&CURPROC->lock);
+
+  return ret;
+}
+
+/**
+  @brief End the current job, and sleep until the next period.
+  */
+int sys_WaitPeriod()
+{
+  TCB* tcb = cur_thread();
+  if(tcb->edf.runtime == 0)
+    return -1;
+
+  /* Only the timeout wakes us up, so there is nothing to wait on */
+  TimerDuration delay = sched_edf_end_job(tcb);
+  if(delay > 0)
+    sleep_releasing(STOPPED, NULL, SCHED_USER, delay);
+  return 0;
+}
+
+/**
+  @brief Return the deadline parameters and statistics of the given thread.
+  */
+int sys_GetDeadline(Tid_t tid, deadline_info* info)
+{
+  PTCB *ptcb = (PTCB *)tid;
+  int ret = -1;
+
+  Mutex_Lock(&CURPROC->lock);
+
+  if(tid == NOTHREAD || rlist_find(&CURPROC->PTCB_list, ptcb, NULL) == NULL || ptcb->exited)
+    goto finish;
+
+  /* The parameters may not have taken effect yet; the counts have */
+  edf_params* A = &ptcb->tcb->edf_admitted;
+  edf_params* E = &ptcb->tcb->edf;
+  if(A->runtime == 0 || info == NULL)
+    goto finish;
+
+  info->runtime = A->runtime;
+  info->period = A->period;
+  info->deadline = A->deadline;
+  info->jobs = (E->runtime != 0) ? E->jobs : 0;
+  info->misses = (E->runtime != 0) ? E->misses : 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&CURPROC->lock);
+  return ret;
+}
+
 /**
   @brief Join the given thread.
   Possible errors are:
@@ -55,16 +206,16 @@ Tid_t sys_ThreadSelf()
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
   PTCB *ptcb = (PTCB *)tid;
-  rlnode *node = rlist_find(&CURPROC->PTCB_list, ptcb, NULL);
+  PCB* curproc = CURPROC;
+  int ret = -1;
 
-  //printf("sys_ThreadJoin: current thread: %p join thread %p\n", sys_ThreadSelf(), tid);
+  Mutex_Lock(&curproc->lock);
 
-  //printf("the pointer is : %p\n" ,node);
-  //printf("%p %d\n", node, tid);
+  rlnode *node = rlist_find(&curproc->PTCB_list, ptcb, NULL);
 
   /* the tid thread doesn't belong to the same process PCB*/
   if(node == NULL){
-    return -1;
+    goto finish;
   }
   
   /* check if
@@ -72,26 +223,21 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
    * the tid corresponds to the current thread.
    * the tid corresponds to a detached thread.
    */
-  //printf("exitval = %p\n" ,*exitval);
   if (tid == NOTHREAD || cur_thread()->owner_ptcb == ptcb || ptcb->detached == 1){
-    return -1;
+    goto finish;
   }
   
   /* Now the thread is joinable. Increaze the number of threads waiting for exit */
   ptcb->refcount++;
 
-  //printf("sys_ThreadJoin: waiting for exit, refcount=%d\n", ptcb->refcount);
-
   /* Make the current thread wait until the (PTCB)tid exits */
   while(ptcb->detached == 0 && ptcb->exited == 0) {
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&curproc->lock, &ptcb->exit_cv, SCHED_USER);
   }
 
-  //printf("sys_ThreadJoin: thread %p continuing... \n", sys_ThreadSelf());
-
   /* If the thread is detached while waiting return -1 */
   if(ptcb->detached == 1){
-    return -1;
+    goto finish;
   }
 
   /* In this level the (PTCB*)tid has exited and the current thread does not have to wait any longer*/
@@ -108,8 +254,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     free(ptcb);
   }
 
-  //printf("sys_ThreadJoin: thread %p exiting... \n", sys_ThreadSelf());
-	return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+	return ret;
 }
 
 /**
@@ -121,36 +270,35 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 */
 int sys_ThreadDetach(Tid_t tid)
 { 
-
-  //printf("%d\n" ,sys_ThreadSelf());
-  
-  //printf("sys_ThreadDetach\n");
-  //printf("state = %d thread_count = %d\n", cur_thread()->state, CURPROC->thread_count);
   if(tid == NOTHREAD){
-    //printf("No Thread\n");
     return -1;
   }
 
   PTCB *ptcb = (PTCB *)tid;
-  rlnode *node = rlist_find(&CURPROC->PTCB_list, ptcb, NULL);
+  PCB* curproc = CURPROC;
+  int ret = -1;
 
-  if(tid == NOTHREAD || node == NULL){
-    return -1;
+  Mutex_Lock(&curproc->lock);
+
+  rlnode *node = rlist_find(&curproc->PTCB_list, ptcb, NULL);
+
+  if(node == NULL){
+    goto finish;
   }
 
   /* Dont check for detached thread, a thread can be detched many times */
   if(ptcb->exited == 1) {
-    return -1;
+    goto finish;
   }
 
-  //printf("%d %d %p %d\n", ptcb->exited, ptcb->detached, node, tid);
-  //printf("thread detached\n");
-
   /* detach thread */
   ptcb->detached = 1; 
   kernel_broadcast(&ptcb->exit_cv);
+  ret = 0;
 
-  return 0;
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return ret;
 }
 
 /**
@@ -163,80 +311,30 @@ void sys_ThreadExit(int exitval)
   TCB* curthread = cur_thread();
   PTCB* curptcb = curthread->owner_ptcb;
 
+  assert((cur_thread()->owner_ptcb) != NULL);
+
+  Mutex_Lock(&curproc->lock);
+
   curptcb->exitval = exitval;
   curptcb->exited = 1;
   curptcb->tcb = NULL;
 
   curproc->thread_count--;
 
-  assert((cur_thread()->owner_ptcb) != NULL);
-
-  //printf("sys_ThreadExit: thread %p refcount=%d\n", curptcb->refcount);
-
   /* Send a signal to the waiting processes if there are  */
   if(curptcb->refcount != 0){
     kernel_broadcast(&curptcb->exit_cv);
   }
 
   if(curproc->thread_count == 0){
-    if(get_pid(curproc)==1) {
-      while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
-    }else{
-
-      /* Reparent any children of the exiting process to the 
-         initial task */
-      PCB* initpcb = get_pcb(1);
-      while(!is_rlist_empty(& curproc->children_list)) {
-        rlnode* child = rlist_pop_front(& curproc->children_list);
-        child->pcb->parent = initpcb;
-        rlist_push_front(& initpcb->children_list, child);
-      }
-
-      /* Add exited children to the initial task's exited list 
-        and signal the initial task */
-      if(!is_rlist_empty(& curproc->exited_list)) {
-        rlist_append(& initpcb->exited_list, &curproc->exited_list);
-        kernel_broadcast(& initpcb->child_exit);
-      }
-
-      /* Put me into my parent's exited list */
-      rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-      kernel_broadcast(& curproc->parent->child_exit);
-    }
-
-    assert(is_rlist_empty(& curproc->children_list));
-    assert(is_rlist_empty(& curproc->exited_list));
-
-
-    /* 
-      Do all the other cleanup we want here, close files etc. 
-    */
-
-    /* Release the args data */
-    if(curproc->args) {
-      free(curproc->args);
-      curproc->args = NULL;
-    }
-
-    /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
-    }
-
-    /* Disconnect my main_thread */
-    curproc->main_thread = NULL;
-
-    /* Now, mark the process as exited. */
-    curproc->pstate = ZOMBIE;
+    /* The last thread takes the process down. No other thread
+       remains to use curptcb, so the lock can be dropped. */
+    Mutex_Unlock(&curproc->lock);
+    exit_process();
   }
 
-  //printf("sys_ThreadExit: thread %p refcount=%d\n", curptcb->refcount);
-
-    /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  /* Bye-bye cruel world. After the lock is released, a joiner 
+     may free curptcb. */
+  Mutex_Unlock(&curproc->lock);
+  sleep_releasing(EXITED, NULL, SCHED_USER, NO_TIMEOUT);
 }
-
-
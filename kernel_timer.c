@@ -0,0 +1,182 @@
+
+#include <assert.h>
+#include "kernel_timer.h"
+
+
+/* The level and slot mask */
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+/* The number of ticks covered by the whole wheel */
+#define WHEEL_SPAN ((TimerDuration)1 << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+
+void timer_wheel_init(timer_wheel* tw, TimerDuration now)
+{
+	tw->tick = now / TIMER_TICK;
+	tw->count = 0;
+	for (int l = 0; l < TIMER_LEVELS; l++)
+		for (int s = 0; s < TIMER_SLOTS; s++)
+			rlnode_init(&tw->slot[l][s], NULL);
+}
+
+
+/*
+  Put a timer in the right slot, relative to the current tick.
+  Timers in the past go to the slot of the current tick.
+ */
+static void timer_place(timer_wheel* tw, timer_node* t)
+{
+	TimerDuration when = t->when / TIMER_TICK;
+
+	if (when < tw->tick)
+		when = tw->tick;
+	else if (when - tw->tick >= WHEEL_SPAN)
+		when = tw->tick + WHEEL_SPAN - 1;
+
+	TimerDuration delta = when - tw->tick;
+
+	/* Find the lowest level whose span covers delta */
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= ((TimerDuration)1 << ((level + 1) * TIMER_SLOT_BITS)))
+		level++;
+
+	uint idx = (when >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+	rlist_push_back(&tw->slot[level][idx], &t->node);
+}
+
+
+void timer_add(timer_wheel* tw, timer_node* t, TimerDuration when)
+{
+	assert(!timer_is_armed(t));
+	t->when = when;
+	timer_place(tw, t);
+	tw->count++;
+}
+
+
+void timer_cancel(timer_wheel* tw, timer_node* t)
+{
+	if (timer_is_armed(t)) {
+		rlist_remove(&t->node);
+		tw->count--;
+	}
+}
+
+
+/*
+  When the current tick enters a new slot at some level, the timers of
+  this slot are distributed to the lower levels.
+ */
+static void timer_cascade(timer_wheel* tw)
+{
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+		if (tw->tick & (((TimerDuration)1 << (level * TIMER_SLOT_BITS)) - 1))
+			break;
+
+		uint idx = (tw->tick >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+		rlnode* S = &tw->slot[level][idx];
+
+		/* Detach the slot, and re-insert its timers */
+		rlnode L;
+		rlnode_init(&L, NULL);
+		rlist_append(&L, S);
+		while (!is_rlist_empty(&L))
+			timer_place(tw, (timer_node*) rlist_pop_front(&L));
+	}
+}
+
+
+/*
+  Return the first tick of the first non-empty slot at some level, or -1.
+  At level 0, the search starts at the current slot; at higher levels,
+  the current slot has been cascaded, and the search starts after it.
+ */
+static TimerDuration timer_next_slot(timer_wheel* tw, int level)
+{
+	int shift = level * TIMER_SLOT_BITS;
+	TimerDuration base = tw->tick >> shift;
+	for (uint i = (level == 0) ? 0 : 1; i <= TIMER_SLOTS; i++) {
+		if (level == 0 && i == TIMER_SLOTS)
+			break;
+		if (!is_rlist_empty(&tw->slot[level][(base + i) & SLOT_MASK]))
+			return (base + i) << shift;
+	}
+	return (TimerDuration)-1;
+}
+
+
+void timer_expire(timer_wheel* tw, TimerDuration now, rlnode* expired)
+{
+	TimerDuration target = now / TIMER_TICK;
+
+	while (1) {
+		/* An empty wheel can jump ahead */
+		if (tw->count == 0) {
+			if (tw->tick < target)
+				tw->tick = target;
+			return;
+		}
+
+		/* Collect the current slot. Before the target tick, all its timers
+		   have expired; at the target tick, only some may have. */
+		rlnode* S = &tw->slot[0][tw->tick & SLOT_MASK];
+		for (rlnode* n = S->next; n != S; ) {
+			timer_node* t = (timer_node*) n;
+			n = n->next;
+			if (t->when <= now) {
+				rlist_push_back(expired, rlist_remove(&t->node));
+				tw->count--;
+			}
+		}
+
+		if (tw->tick >= target)
+			return;
+
+		/* Jump to the next tick at which a non-empty slot is entered, at
+		   any level, or to the target. No timers are passed on the way, 
+		   so only the slots entered at the new tick need cascading. */
+		TimerDuration next = target;
+		for (int level = 0; level < TIMER_LEVELS; level++) {
+			/* A higher level slot cannot start before the next boundary */
+			int shift = level * TIMER_SLOT_BITS;
+			if (level > 0 && next <= ((tw->tick >> shift) + 1) << shift)
+				break;
+			TimerDuration start = timer_next_slot(tw, level);
+			if (start < next)
+				next = start;
+		}
+		if (next <= tw->tick)
+			next = tw->tick + 1;
+
+		tw->tick = next;
+		timer_cascade(tw);
+	}
+}
+
+
+TimerDuration timer_next(timer_wheel* tw)
+{
+	if (tw->count == 0)
+		return (TimerDuration)-1;
+
+	TimerDuration next = (TimerDuration)-1;
+
+	/* At level 0, the first non-empty slot contains the earliest timers
+	   of this level; find the exact minimum. */
+	TimerDuration start = timer_next_slot(tw, 0);
+	if (start != (TimerDuration)-1) {
+		rlnode* S = &tw->slot[0][start & SLOT_MASK];
+		for (rlnode* n = S->next; n != S; n = n->next)
+			if (((timer_node*) n)->when < next)
+				next = ((timer_node*) n)->when;
+	}
+
+	/* At higher levels, take the start of the first non-empty slot */
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+		start = timer_next_slot(tw, level);
+		if (start != (TimerDuration)-1 && start * TIMER_TICK < next)
+			next = start * TIMER_TICK;
+	}
+
+	return next;
+}
@@ -0,0 +1,155 @@
+/*
+ *  Timer wheel API
+ *
+ */
+
+#ifndef __KERNEL_TIMER_H
+#define __KERNEL_TIMER_H
+
+/**
+  @file kernel_timer.h
+  @brief TinyOS kernel: A hierarchical timer wheel.
+
+  @defgroup timer Timers
+  @ingroup kernel
+  @brief A hierarchical timer wheel.
+
+  The timer wheel holds a set of timers, each with an expiration time, and
+  supports adding and cancelling a timer in @f$ O(1) @f$ time. Expired timers
+  are collected in batches, by calling @c timer_expire() with the current
+  time.
+
+  Time is divided into ticks of @c TIMER_TICK microseconds. The wheel has
+  @c TIMER_LEVELS levels of @c TIMER_SLOTS slots each. A slot of level 0
+  holds the timers of a single tick, a slot of level 1 holds the timers of
+  @c TIMER_SLOTS ticks, and so on. As time advances, the timers of a slot
+  of some level are moved (cascaded) to the level below it.
+
+  The timer wheel is not synchronized; the user must provide the locking.
+
+  @{
+*/
+
+#include "bios.h"
+#include "util.h"
+
+
+/** @brief The duration of a tick of the wheel, in microseconds. */
+#define TIMER_TICK 1000
+
+/** @brief log2 of the number of slots per level */
+#define TIMER_SLOT_BITS 6
+
+/** @brief The number of slots per level */
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/** @brief The number of levels of the wheel.
+
+  The wheel covers @f$ 2^{24} @f$ ticks (about 4.6 hours). Timers further
+  in the future are kept at the farthest slot, and are re-examined
+  when this slot is cascaded.
+  */
+#define TIMER_LEVELS 4
+
+
+/**
+  @brief A timer.
+
+  This object is embedded in the object that is to be notified. The @c node.obj
+  field can be used to point to this object.
+ */
+typedef struct timer_node {
+	rlnode node;         /**< @brief Node in a slot of the wheel */
+	TimerDuration when;  /**< @brief The expiration time of the timer */
+} timer_node;
+
+
+/**
+  @brief A hierarchical timer wheel.
+ */
+typedef struct timer_wheel {
+	TimerDuration tick;    /**< @brief The current tick. Earlier ticks have been expired */
+	size_t count;          /**< @brief The number of timers in the wheel */
+	rlnode slot[TIMER_LEVELS][TIMER_SLOTS];   /**< @brief The slots of the wheel */
+} timer_wheel;
+
+
+/**
+  @brief Initialize a timer wheel.
+
+  @param tw the wheel to initialize
+  @param now the current time
+ */
+void timer_wheel_init(timer_wheel* tw, TimerDuration now);
+
+/**
+  @brief Initialize a timer.
+
+  @param t the timer to initialize
+  @param obj the owner object, stored in @c t->node.obj
+  @returns the timer
+ */
+static inline timer_node* timer_node_init(timer_node* t, void* obj)
+{
+	rlnode_init(&t->node, obj);
+	t->when = (TimerDuration)-1;
+	return t;
+}
+
+/**
+  @brief Return true if the timer is in some wheel.
+ */
+static inline int timer_is_armed(timer_node* t)
+{
+	return t->node.next != &t->node;
+}
+
+/**
+  @brief Add a timer to the wheel.
+
+  The timer must not be in the wheel already. If @c when is not later than
+  the time of the last call to @c timer_expire(), the timer will expire on
+  the next call.
+
+  @param tw the wheel
+  @param t the timer
+  @param when the expiration time
+ */
+void timer_add(timer_wheel* tw, timer_node* t, TimerDuration when);
+
+/**
+  @brief Remove a timer from the wheel.
+
+  If the timer is not in the wheel, this call has no effect.
+
+  @param tw the wheel
+  @param t the timer
+ */
+void timer_cancel(timer_wheel* tw, timer_node* t);
+
+/**
+  @brief Remove all expired timers from the wheel.
+
+  All timers whose time is not later than @c now are removed from the
+  wheel and are appended to list @c expired. The timers are appended
+  roughly in order of expiration, but this is not guaranteed within the
+  same tick.
+
+  @param tw the wheel
+  @param now the current time; it must not decrease between calls
+  @param expired a list to append the expired timers to
+ */
+void timer_expire(timer_wheel* tw, TimerDuration now, rlnode* expired);
+
+/**
+  @brief Return a lower bound for the earliest timer in the wheel.
+
+  The returned time is never later than the expiration time of any timer
+  in the wheel. If the wheel is empty, @c (TimerDuration)-1 is returned.
+ */
+TimerDuration timer_next(timer_wheel* tw);
+
+
+/** @} */
+
+#endif
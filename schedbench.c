@@ -0,0 +1,1364 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/resource.h>
+
+#include "tinyos.h"
+#include "bios.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+#include "symposium.h"
+
+
+/*
+ 	A standalone program to benchmark the scheduler.
+
+ 	Each benchmark is a mode of the program, selected by the first
+ 	argument. The benchmark is repeated for 1, 2, ... up to the
+ 	given number of cores, in order to show how the scheduler scales.
+ */
+
+
+/* Return the host's monotonic time in seconds */
+static double wall_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+
+/****************************************************
+  Context switch benchmark.
+
+  Pairs of threads pass a token back and forth, each pass
+  forcing a context switch. With N cores, N pairs are running.
+ ****************************************************/
+
+typedef struct ping_pong {
+  Mutex mx;
+  CondVar cv;
+  int turn;
+  int rounds;
+} ping_pong;
+
+typedef struct ctxswitch_args {
+  int pairs;
+  int rounds;
+  double* elapsed;    /* where to return the time measured */
+} ctxswitch_args;
+
+static int ping_pong_player(int side, void* arg)
+{
+  ping_pong* pp = arg;
+
+  for(int i=0; i<pp->rounds; i++) {
+    Mutex_Lock(&pp->mx);
+    while(pp->turn != side)
+      Cond_Wait(&pp->mx, &pp->cv);
+    pp->turn = 1-side;
+    Cond_Signal(&pp->cv);
+    Mutex_Unlock(&pp->mx);
+  }
+  return 0;
+}
+
+static int boot_ctxswitch(int argl, void* args)
+{
+  ctxswitch_args* A = args;
+  ping_pong pp[A->pairs];
+  Tid_t tid[2*A->pairs];
+
+  double start = wall_time();
+
+  for(int p=0; p<A->pairs; p++) {
+    pp[p] = (ping_pong) { MUTEX_INIT, COND_INIT, 0, A->rounds };
+    tid[2*p] = CreateThread(ping_pong_player, 0, &pp[p]);
+    tid[2*p+1] = CreateThread(ping_pong_player, 1, &pp[p]);
+  }
+
+  for(int t=0; t<2*A->pairs; t++)
+    ThreadJoin(tid[t], NULL);
+
+  *A->elapsed = wall_time() - start;
+  return 0;
+}
+
+static void bench_ctxswitch(uint maxcores, int rounds)
+{
+  double base = 0.0;
+
+  printf("%6s %8s %12s %14s %8s\n", "cores", "pairs", "time (s)", "switches/s", "speedup");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    double elapsed;
+    ctxswitch_args A = { ncores, rounds, &elapsed };
+    boot(ncores, 0, boot_ctxswitch, sizeof(A), &A);
+
+    double rate = 2.0 * rounds * ncores / elapsed;
+    if(ncores==1) base = rate;
+    printf("%6u %8u %12.3f %14.0f %8.2f\n", ncores, ncores, elapsed, rate, rate/base);
+  }
+}
+
+
+/****************************************************
+  Raw context switch benchmark.
+
+  Two contexts switch back and forth, without the scheduler, by
+  cpu_swap_context() and by swapcontext(3). This does not boot the VM.
+ ****************************************************/
+
+#define SWAP_STACK_SIZE (64*1024)
+
+static cpu_context_t swap_main_ctx, swap_peer_ctx;
+static ucontext_t uc_main_ctx, uc_peer_ctx;
+
+static void swap_peer()
+{
+  for(;;) cpu_swap_context(&swap_peer_ctx, &swap_main_ctx);
+}
+
+static void uc_peer()
+{
+  for(;;) swapcontext(&uc_peer_ctx, &uc_main_ctx);
+}
+
+static void bench_swap(int rounds)
+{
+  void* stack1 = malloc(SWAP_STACK_SIZE);
+  void* stack2 = malloc(SWAP_STACK_SIZE);
+
+  printf("%18s %10s %12s %12s\n", "switch", "rounds", "time (s)", "ns/switch");
+
+  cpu_initialize_context(&swap_peer_ctx, stack1, SWAP_STACK_SIZE, swap_peer);
+  double t0 = wall_time();
+  for(int i=0; i<rounds; i++)
+    cpu_swap_context(&swap_main_ctx, &swap_peer_ctx);
+  double t1 = wall_time();
+  printf("%18s %10d %12.3f %12.1f\n", "cpu_swap_context", rounds, t1-t0, (t1-t0)*1E9/(2.0*rounds));
+
+  getcontext(&uc_peer_ctx);
+  uc_peer_ctx.uc_link = NULL;
+  uc_peer_ctx.uc_stack.ss_sp = stack2;
+  uc_peer_ctx.uc_stack.ss_size = SWAP_STACK_SIZE;
+  makecontext(&uc_peer_ctx, uc_peer, 0);
+  t0 = wall_time();
+  for(int i=0; i<rounds; i++)
+    swapcontext(&uc_main_ctx, &uc_peer_ctx);
+  t1 = wall_time();
+  printf("%18s %10d %12.3f %12.1f\n", "swapcontext", rounds, t1-t0, (t1-t0)*1E9/(2.0*rounds));
+
+  free(stack1);
+  free(stack2);
+}
+
+
+/****************************************************
+  Thread creation benchmark.
+
+  On N cores, N spawner threads repeatedly create a thread which 
+  does nothing, and join it.
+ ****************************************************/
+
+typedef struct spawn_args {
+  int spawners;
+  int threads;
+  double* elapsed;
+} spawn_args;
+
+static int empty_thread(int argl, void* args) { return 0; }
+
+static int spawner_thread(int argl, void* args)
+{
+  for(int i=0; i<argl; i++)
+    ThreadJoin(CreateThread(empty_thread, 0, NULL), NULL);
+  return 0;
+}
+
+static int boot_spawn(int argl, void* args)
+{
+  spawn_args* A = args;
+  Tid_t tid[A->spawners];
+
+  double start = wall_time();
+  for(int s=0; s<A->spawners; s++)
+    tid[s] = CreateThread(spawner_thread, A->threads, NULL);
+  for(int s=0; s<A->spawners; s++)
+    ThreadJoin(tid[s], NULL);
+  *A->elapsed = wall_time() - start;
+  return 0;
+}
+
+static void bench_spawn(uint maxcores, int threads)
+{
+  double base = 0.0;
+
+  printf("%6s %12s %14s %8s\n", "cores", "time (s)", "threads/s", "speedup");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    double elapsed;
+    spawn_args A = { ncores, threads, &elapsed };
+    boot(ncores, 0, boot_spawn, sizeof(A), &A);
+
+    double rate = (double)threads * ncores / elapsed;
+    if(ncores==1) base = rate;
+    printf("%6u %12.3f %14.0f %8.2f\n", ncores, elapsed, rate, rate/base);
+  }
+}
+
+
+/****************************************************
+  Pipeline benchmark.
+
+  A source thread pushes data through a chain of threads connected
+  by bounded buffers, to a sink thread. The number of thread migrations
+  between cores is reported with the throughput.
+ ****************************************************/
+
+#define PIPELINE_CHUNK 4096
+#define CHANNEL_SIZE (16*1024)
+
+/* A bounded byte buffer, like a pipe */
+typedef struct channel {
+  Mutex mx;
+  CondVar has_data, has_space;
+  char buffer[CHANNEL_SIZE];
+  size_t head, count;
+  int closed;
+} channel;
+
+static void channel_write(channel* ch, const char* buf, size_t n)
+{
+  Mutex_Lock(&ch->mx);
+  while(n > 0) {
+    while(ch->count == CHANNEL_SIZE)
+      Cond_Wait(&ch->mx, &ch->has_space);
+    for(; n > 0 && ch->count < CHANNEL_SIZE; n--, ch->count++)
+      ch->buffer[(ch->head + ch->count) % CHANNEL_SIZE] = *buf++;
+    Cond_Broadcast(&ch->has_data);
+  }
+  Mutex_Unlock(&ch->mx);
+}
+
+static size_t channel_read(channel* ch, char* buf, size_t n)
+{
+  size_t got = 0;
+  Mutex_Lock(&ch->mx);
+  while(ch->count == 0 && !ch->closed)
+    Cond_Wait(&ch->mx, &ch->has_data);
+  for(; got < n && ch->count > 0; got++, ch->count--) {
+    buf[got] = ch->buffer[ch->head];
+    ch->head = (ch->head + 1) % CHANNEL_SIZE;
+  }
+  Cond_Broadcast(&ch->has_space);
+  Mutex_Unlock(&ch->mx);
+  return got;
+}
+
+static void channel_close(channel* ch)
+{
+  Mutex_Lock(&ch->mx);
+  ch->closed = 1;
+  Cond_Broadcast(&ch->has_data);
+  Mutex_Unlock(&ch->mx);
+}
+
+typedef struct pipeline_args {
+  int stages;
+  int mbytes;
+  double* elapsed;
+} pipeline_args;
+
+typedef struct pipeline_stage {
+  channel *in, *out;   /* NULL at the source and the sink, respectively */
+  long bytes;          /* for the source */
+} pipeline_stage;
+
+static int pipeline_thread(int argl, void* args)
+{
+  pipeline_stage* S = args;
+  char buf[PIPELINE_CHUNK];
+  memset(buf, 0, sizeof(buf));
+
+  if(S->in == NULL) {
+    for(long sent=0; sent < S->bytes; sent += PIPELINE_CHUNK)
+      channel_write(S->out, buf, PIPELINE_CHUNK);
+  } else {
+    size_t n;
+    while((n = channel_read(S->in, buf, PIPELINE_CHUNK)) > 0)
+      if(S->out != NULL) channel_write(S->out, buf, n);
+  }
+
+  if(S->out != NULL) channel_close(S->out);
+  return 0;
+}
+
+static int boot_pipeline(int argl, void* args)
+{
+  pipeline_args* A = args;
+  int n = A->stages + 2;
+  pipeline_stage S[n];
+  Tid_t tid[n];
+  channel* ch = calloc(n-1, sizeof(channel));
+
+  for(int i=0; i<n; i++)
+    S[i] = (pipeline_stage) { i>0 ? &ch[i-1] : NULL, i<n-1 ? &ch[i] : NULL, 0 };
+  S[0].bytes = (long)A->mbytes << 20;
+  for(int i=0; i<n-1; i++)
+    ch[i] = (channel) { .mx = MUTEX_INIT, .has_data = COND_INIT, .has_space = COND_INIT };
+
+  double start = wall_time();
+  for(int i=0; i<n; i++)
+    tid[i] = CreateThread(pipeline_thread, 0, &S[i]);
+  for(int i=0; i<n; i++)
+    ThreadJoin(tid[i], NULL);
+  *A->elapsed = wall_time() - start;
+
+  free(ch);
+  return 0;
+}
+
+static void bench_pipeline(uint maxcores, int stages, int mbytes)
+{
+  printf("%6s %8s %12s %10s %12s\n", "cores", "stages", "time (s)", "MB/s", "migrations");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    double elapsed;
+    pipeline_args A = { stages, mbytes, &elapsed };
+    boot(ncores, 0, boot_pipeline, sizeof(A), &A);
+
+    unsigned long migrations = 0;
+    for(uint c=0; c<ncores; c++) migrations += cctx[c].migrations;
+    printf("%6u %8d %12.3f %10.1f %12lu\n", ncores, stages, elapsed, mbytes/elapsed, migrations);
+  }
+}
+
+
+/****************************************************
+  Thread memory benchmark.
+
+  Create many threads that block, and measure the resident memory
+  of the host process, per thread.
+ ****************************************************/
+
+typedef struct stacks_args {
+  int threads;
+  size_t stack_size;
+  double* rss_per_thread;   /* where to return the memory measured */
+} stacks_args;
+
+typedef struct stacks_gate {
+  Mutex mx;
+  CondVar cv;        /* signalled when the gate opens */
+  CondVar blocked_cv;  /* signalled when a thread blocks */
+  int open;
+  int blocked;
+} stacks_gate;
+
+/* Return the resident memory of the host process, in bytes */
+static long resident_memory()
+{
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if(f == NULL) return 0;
+  if(fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int blocked_thread(int argl, void* args)
+{
+  stacks_gate* G = args;
+  Mutex_Lock(&G->mx);
+  G->blocked++;
+  Cond_Signal(&G->blocked_cv);
+  while(! G->open)
+    Cond_Wait(&G->mx, &G->cv);
+  Mutex_Unlock(&G->mx);
+  return 0;
+}
+
+static int boot_stacks(int argl, void* args)
+{
+  stacks_args* A = args;
+  stacks_gate G = { MUTEX_INIT, COND_INIT, COND_INIT, 0, 0 };
+  Tid_t* tid = malloc(A->threads * sizeof(Tid_t));
+
+  long before = resident_memory();
+  for(int t=0; t<A->threads; t++)
+    tid[t] = CreateThreadStack(blocked_thread, 0, &G, A->stack_size);
+  Mutex_Lock(&G.mx);
+  while(G.blocked < A->threads)
+    Cond_Wait(&G.mx, &G.blocked_cv);
+  long after = resident_memory();
+  G.open = 1;
+  Cond_Broadcast(&G.cv);
+  Mutex_Unlock(&G.mx);
+  for(int t=0; t<A->threads; t++)
+    ThreadJoin(tid[t], NULL);
+  free(tid);
+
+  *A->rss_per_thread = (double)(after - before) / A->threads;
+  return 0;
+}
+
+static void bench_stacks(int threads)
+{
+  size_t sizes[] = { 16*1024, THREAD_STACK_SIZE, 1024*1024, THREAD_STACK_MAX };
+
+  printf("%12s %8s %18s\n", "stack (KB)", "threads", "resident KB/thread");
+  for(uint i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+    double rss;
+    stacks_args A = { threads, sizes[i], &rss };
+    boot(1, 0, boot_stacks, sizeof(A), &A);
+    printf("%12zu %8d %18.1f\n", sizes[i]/1024, threads, rss/1024);
+  }
+}
+
+
+/****************************************************
+  Wakeup latency benchmark.
+
+  On each core, a CPU-bound thread is running. One of them wakes up
+  a responder thread once every millisecond, and the responder measures
+  the time until it runs. The responder runs at the default priority,
+  sharing the cpu in time slices, and at the highest priority, where it
+  preempts the CPU-bound threads.
+ ****************************************************/
+
+/* Latency histogram buckets: < 1, 2, 4, ... 256 usec, and the rest */
+#define LAT_BUCKETS 10
+
+typedef struct latency_args {
+  int hogs;
+  int rounds;
+  int priority;     /* the priority of the responder */
+  double* mean;     /* where to return the latencies measured */
+  double* max;
+  unsigned long* hist;  /* if not NULL, where to return the histogram */
+  int nap;          /* the waker sleeps between wakeups, instead of spinning */
+} latency_args;
+
+typedef struct latency_state {
+  Mutex mx;
+  CondVar cv;
+  int rounds;
+  int pending;      /* a wakeup is pending */
+  int done;
+  double posted;    /* the time of the wakeup */
+  double total, max;
+  unsigned long hist[LAT_BUCKETS];
+  int nap;
+} latency_state;
+
+static int latency_responder(int argl, void* args)
+{
+  latency_state* S = args;
+  Mutex_Lock(&S->mx);
+  for(int i=0; i<S->rounds; i++) {
+    while(! S->pending)
+      Cond_Wait(&S->mx, &S->cv);
+    double lat = wall_time() - S->posted;
+    S->total += lat;
+    if(lat > S->max) S->max = lat;
+    int b = 0;
+    while(b < LAT_BUCKETS-1 && lat*1E6 >= (1 << b)) b++;
+    S->hist[b]++;
+    S->pending = 0;
+  }
+  S->done = 1;
+  Mutex_Unlock(&S->mx);
+  return 0;
+}
+
+static int latency_hog(int waker, void* args)
+{
+  latency_state* S = args;
+  double next = wall_time();
+  Mutex napmx = MUTEX_INIT;
+  CondVar napcv = COND_INIT;
+  while(! __atomic_load_n(&S->done, __ATOMIC_RELAXED)) {
+    if(waker && S->nap) {
+      Mutex_Lock(&napmx);
+      Cond_TimedWait(&napmx, &napcv, 1);
+      Mutex_Unlock(&napmx);
+    }
+    if(waker && wall_time() >= next) {
+      next += 1E-3;
+      /* Signal after unlocking, else the responder would find the
+         mutex locked */
+      Mutex_Lock(&S->mx);
+      int post = ! S->pending;
+      if(post) {
+        S->pending = 1;
+        S->posted = wall_time();
+      }
+      Mutex_Unlock(&S->mx);
+      if(post) Cond_Signal(&S->cv);
+    }
+  }
+  return 0;
+}
+
+static int boot_latency(int argl, void* args)
+{
+  latency_args* A = args;
+  latency_state S = { MUTEX_INIT, COND_INIT, A->rounds, 0, 0, 0.0, 0.0, 0.0, { 0 }, A->nap };
+  Tid_t tid[A->hogs];
+
+  Tid_t resp = CreateThreadPriority(latency_responder, 0, &S, A->priority);
+  for(int h=0; h<A->hogs; h++)
+    tid[h] = CreateThreadPriority(latency_hog, h==0, &S, PRIORITY_DEFAULT);
+
+  ThreadJoin(resp, NULL);
+  for(int h=0; h<A->hogs; h++)
+    ThreadJoin(tid[h], NULL);
+
+  *A->mean = S.total / A->rounds;
+  *A->max = S.max;
+  if(A->hist)
+    memcpy(A->hist, S.hist, sizeof(S.hist));
+  return 0;
+}
+
+static void bench_latency(uint maxcores, int rounds)
+{
+  int prio[] = { PRIORITY_DEFAULT, PRIORITY_HIGHEST };
+
+  printf("%6s %10s %16s %16s\n", "cores", "priority", "mean (usec)", "max (usec)");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    for(uint p=0; p<2; p++) {
+      double mean, max;
+      latency_args A = { ncores, rounds, prio[p], &mean, &max, NULL, 0 };
+      boot(ncores, 0, boot_latency, sizeof(A), &A);
+      printf("%6u %10d %16.1f %16.1f\n", ncores, prio[p], mean*1E6, max*1E6);
+    }
+  }
+}
+
+
+/*
+  The same, on 2 cores, with a single waker that sleeps between wakeups:
+  the responder wakes up on a halted core. The latency histogram is 
+  reported with halted cores waiting for a signal, and on a futex.
+ */
+static void bench_wakeup(int rounds)
+{
+  printf("%8s", "halt");
+  for(int b=0; b<LAT_BUCKETS-1; b++) {
+    char label[16];
+    snprintf(label, sizeof(label), "<%d", 1 << b);
+    printf(" %7s", label);
+  }
+  printf(" %7s %10s\n", "more", "mean (usec)");
+
+  const char* modes[] = { "signal", "futex" };
+  for(int futex=0; futex<2; futex++) {
+    setenv("TINYOS_HALT_FUTEX", futex ? "1" : "0", 1);
+    double mean, max;
+    unsigned long hist[LAT_BUCKETS];
+    latency_args A = { 1, rounds, PRIORITY_DEFAULT, &mean, &max, hist, 1 };
+    boot(2, 0, boot_latency, sizeof(A), &A);
+    printf("%8s", modes[futex]);
+    for(int b=0; b<LAT_BUCKETS; b++)
+      printf(" %7lu", hist[b]);
+    printf(" %10.1f\n", mean*1E6);
+  }
+}
+
+
+/****************************************************
+  System call benchmark.
+
+  With N cores, N threads each open a null stream and write 
+  to it in a loop. The calls are independent, so their throughput
+  should scale with the cores.
+ ****************************************************/
+
+typedef struct syscall_args {
+  int threads;
+  int calls;
+  double* elapsed;
+} syscall_args;
+
+static int null_writer(int argl, void* args)
+{
+  char buf[64] = { 0 };
+  Fid_t fid = OpenNull();
+  assert(fid != NOFILE);
+  for(int i=0; i<argl; i++)
+    Write(fid, buf, sizeof(buf));
+  Close(fid);
+  return 0;
+}
+
+static int boot_syscall(int argl, void* args)
+{
+  syscall_args* A = args;
+  Tid_t tid[A->threads];
+
+  double start = wall_time();
+  for(int t=0; t<A->threads; t++)
+    tid[t] = CreateThread(null_writer, A->calls, NULL);
+  for(int t=0; t<A->threads; t++)
+    ThreadJoin(tid[t], NULL);
+  *A->elapsed = wall_time() - start;
+  return 0;
+}
+
+static void bench_syscall(uint maxcores, int calls)
+{
+  double base = 0.0;
+
+  printf("%6s %8s %12s %14s %8s\n", "cores", "threads", "time (s)", "calls/s", "speedup");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    double elapsed;
+    syscall_args A = { ncores, calls, &elapsed };
+    boot(ncores, 0, boot_syscall, sizeof(A), &A);
+
+    double rate = (double)calls * ncores / elapsed;
+    if(ncores==1) base = rate;
+    printf("%6u %8u %12.3f %14.0f %8.2f\n", ncores, ncores, elapsed, rate, rate/base);
+  }
+}
+
+
+/****************************************************
+  Symposium benchmark.
+
+  Many philosophers dine around a table, as in symposium.c, with short
+  thinking and eating periods and no output. They all contend for the
+  mutex of the table. The time to lock the mutex is measured, and the
+  CPU time used by the VM is compared to the elapsed time.
+ ****************************************************/
+
+enum { DINER_THINKING, DINER_HUNGRY, DINER_EATING };
+
+typedef struct dinner_args {
+  int N;
+  int bites;
+  double* elapsed;
+  double* waits;    /* the lock waits, 2*N*bites of them */
+} dinner_args;
+
+typedef struct dinner {
+  Mutex mx;
+  int N, bites;
+  int* state;
+  CondVar* hungry;
+  double* waits;
+  int nwaits;
+} dinner;
+
+static double cpu_time()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec 
+    + 1E-6*(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void dinner_lock(dinner* D)
+{
+  double start = wall_time();
+  Mutex_Lock(&D->mx);
+  D->waits[D->nwaits++] = wall_time() - start;
+}
+
+static void dinner_test(dinner* D, int i)
+{
+  int N = D->N;
+  if(D->state[i]==DINER_HUNGRY 
+    && D->state[(i+1)%N]!=DINER_EATING && D->state[(i+N-1)%N]!=DINER_EATING) {
+    D->state[i] = DINER_EATING;
+    Cond_Signal(&D->hungry[i]);
+  }
+}
+
+static int diner(int i, void* args)
+{
+  dinner* D = args;
+  for(int b=0; b<D->bites; b++) {
+    fibo(15);   /* think */
+
+    dinner_lock(D);
+    D->state[i] = DINER_HUNGRY;
+    dinner_test(D, i);
+    while(D->state[i] != DINER_EATING)
+      Cond_Wait(&D->mx, &D->hungry[i]);
+    Mutex_Unlock(&D->mx);
+
+    fibo(15);   /* eat */
+
+    dinner_lock(D);
+    D->state[i] = DINER_THINKING;
+    dinner_test(D, (i+1) % D->N);
+    dinner_test(D, (i+D->N-1) % D->N);
+    Mutex_Unlock(&D->mx);
+  }
+  return 0;
+}
+
+static int boot_dinner(int argl, void* args)
+{
+  dinner_args* A = args;
+  int N = A->N;
+  int state[N];
+  CondVar hungry[N];
+  Tid_t tid[N];
+  dinner D = { MUTEX_INIT, N, A->bites, state, hungry, A->waits, 0 };
+
+  for(int i=0; i<N; i++) {
+    state[i] = DINER_THINKING;
+    hungry[i] = COND_INIT;
+  }
+
+  double start = wall_time();
+  for(int i=0; i<N; i++)
+    tid[i] = CreateThread(diner, i, &D);
+  for(int i=0; i<N; i++)
+    ThreadJoin(tid[i], NULL);
+  *A->elapsed = wall_time() - start;
+  return 0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x>y) - (x<y);
+}
+
+static void bench_symposium(uint maxcores, int N, int bites)
+{
+  int nwaits = 2*N*bites;
+  double* waits = malloc(nwaits * sizeof(double));
+
+  printf("%6s %8s %10s %10s %12s %12s %12s\n", "cores", "diners", "time (s)", "cpu (s)",
+    "p50 (usec)", "p99 (usec)", "max (usec)");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    double elapsed;
+    dinner_args A = { N, bites, &elapsed, waits };
+
+    double cpu = cpu_time();
+    boot(ncores, 0, boot_dinner, sizeof(A), &A);
+    cpu = cpu_time() - cpu;
+
+    qsort(waits, nwaits, sizeof(double), compare_double);
+    printf("%6u %8d %10.3f %10.3f %12.1f %12.1f %12.1f\n", ncores, N, elapsed, cpu,
+      waits[nwaits/2]*1E6, waits[nwaits - nwaits/100 - 1]*1E6, waits[nwaits-1]*1E6);
+  }
+  free(waits);
+}
+
+
+/****************************************************
+  Broadcast benchmark.
+
+  Many threads wait on a condition variable, under the same mutex, for
+  the next round. The main thread waits until all have arrived, and 
+  starts the next round by a broadcast, with the mutex locked.
+ ****************************************************/
+
+typedef struct broadcast_args {
+  int waiters;
+  int rounds;
+  double* elapsed;
+} broadcast_args;
+
+typedef struct broadcast_state {
+  Mutex mx;
+  CondVar go, arrived_cv;
+  int waiters, rounds;
+  int arrived, round;
+} broadcast_state;
+
+static int broadcast_waiter(int argl, void* args)
+{
+  broadcast_state* S = args;
+  Mutex_Lock(&S->mx);
+  for(int r=0; r<S->rounds; r++) {
+    if(++S->arrived == S->waiters)
+      Cond_Signal(&S->arrived_cv);
+    while(S->round == r)
+      Cond_Wait(&S->mx, &S->go);
+  }
+  Mutex_Unlock(&S->mx);
+  return 0;
+}
+
+static int boot_broadcast(int argl, void* args)
+{
+  broadcast_args* A = args;
+  broadcast_state S = { MUTEX_INIT, COND_INIT, COND_INIT, A->waiters, A->rounds, 0, 0 };
+  Tid_t tid[A->waiters];
+
+  for(int t=0; t<A->waiters; t++)
+    tid[t] = CreateThread(broadcast_waiter, 0, &S);
+
+  double start = wall_time();
+  Mutex_Lock(&S.mx);
+  for(int r=0; r<A->rounds; r++) {
+    while(S.arrived < S.waiters)
+      Cond_Wait(&S.mx, &S.arrived_cv);
+    S.arrived = 0;
+    S.round++;
+    Cond_Broadcast(&S.go);
+  }
+  Mutex_Unlock(&S.mx);
+  for(int t=0; t<A->waiters; t++)
+    ThreadJoin(tid[t], NULL);
+  *A->elapsed = wall_time() - start;
+  return 0;
+}
+
+static void bench_broadcast(uint maxcores, int waiters, int rounds)
+{
+  printf("%6s %8s %12s %14s\n", "cores", "waiters", "time (s)", "usec/round");
+  for(uint ncores=1; ncores<=maxcores; ncores++) {
+    double elapsed;
+    broadcast_args A = { waiters, rounds, &elapsed };
+    boot(ncores, 0, boot_broadcast, sizeof(A), &A);
+    printf("%6u %8d %12.3f %14.1f\n", ncores, waiters, elapsed, elapsed*1E6/rounds);
+  }
+}
+
+
+/****************************************************
+  Spinlock benchmark.
+
+  On N cores, N threads lock and unlock the same spinlock in a loop,
+  with preemption off, incrementing a counter. The test-and-set 
+  Spinlock is compared to the queue spinlock McsLock.
+ ****************************************************/
+
+typedef struct spinlock_args {
+  int threads;
+  int ops;
+  int mcs;          /* use the McsLock */
+  double* elapsed;
+} spinlock_args;
+
+typedef struct spinlock_state {
+  Spinlock tas;
+  McsLock mcs;
+  int ops;
+  unsigned long counter;
+} spinlock_state;
+
+static int tas_contender(int argl, void* args)
+{
+  spinlock_state* S = args;
+  int preempt = preempt_off;
+  for(int i=0; i<S->ops; i++) {
+    Spin_Lock(&S->tas);
+    S->counter++;
+    Spin_Unlock(&S->tas);
+  }
+  if(preempt) preempt_on;
+  return 0;
+}
+
+static int mcs_contender(int argl, void* args)
+{
+  spinlock_state* S = args;
+  int preempt = preempt_off;
+  for(int i=0; i<S->ops; i++) {
+    Mcs_Lock(&S->mcs);
+    S->counter++;
+    Mcs_Unlock(&S->mcs);
+  }
+  if(preempt) preempt_on;
+  return 0;
+}
+
+static int boot_spinlock(int argl, void* args)
+{
+  spinlock_args* A = args;
+  spinlock_state S = { SPINLOCK_INIT, MCS_LOCK_INIT, A->ops, 0 };
+  Tid_t tid[A->threads];
+
+  double start = wall_time();
+  for(int t=0; t<A->threads; t++)
+    tid[t] = CreateThread(A->mcs ? mcs_contender : tas_contender, 0, &S);
+  for(int t=0; t<A->threads; t++)
+    ThreadJoin(tid[t], NULL);
+  *A->elapsed = wall_time() - start;
+
+  assert(S.counter == (unsigned long) A->threads * A->ops);
+  return 0;
+}
+
+static void bench_spinlock(uint maxcores, int ops)
+{
+  printf("%6s %14s %14s\n", "cores", "TAS (ops/s)", "MCS (ops/s)");
+  for(uint ncores=1; ncores<=maxcores; ncores*=2) {
+    double rate[2];
+    for(int mcs=0; mcs<2; mcs++) {
+      double elapsed;
+      spinlock_args A = { ncores, ops, mcs, &elapsed };
+      boot(ncores, 0, boot_spinlock, sizeof(A), &A);
+      rate[mcs] = (double)ops * ncores / elapsed;
+    }
+    printf("%6u %14.0f %14.0f\n", ncores, rate[0], rate[1]);
+  }
+}
+
+
+/****************************************************
+  Reader-writer lock benchmark.
+
+  On N cores, N threads look up a shared table in a loop; one lookup
+  in every 100 is an update. The table is protected by a RWLock, and 
+  then by a Mutex, for comparison.
+ ****************************************************/
+
+#define RWBENCH_TABLE 64
+#define RWBENCH_WRITES 100    /* one write every this many ops */
+
+typedef struct rwlock_args {
+  int threads;
+  int ops;
+  int mutex;        /* use a Mutex instead of the RWLock */
+  double* elapsed;
+} rwlock_args;
+
+typedef struct rwlock_state {
+  RWLock rw;
+  Mutex mx;
+  int ops;
+  int mutex;
+  int table[RWBENCH_TABLE];
+} rwlock_state;
+
+static int rwlock_contender(int argl, void* args)
+{
+  rwlock_state* S = args;
+  unsigned long sum = 0;
+  for(int i=0; i<S->ops; i++) {
+    int write = (i % RWBENCH_WRITES) == 0;
+    if(S->mutex) Mutex_Lock(&S->mx);
+    else if(write) RWLock_WriteLock(&S->rw);
+    else RWLock_ReadLock(&S->rw);
+
+    if(write)
+      S->table[(i+argl) % RWBENCH_TABLE]++;
+    else
+      sum += S->table[(i+argl) % RWBENCH_TABLE];
+
+    if(S->mutex) Mutex_Unlock(&S->mx);
+    else RWLock_Unlock(&S->rw);
+  }
+  return sum & 1;
+}
+
+static int boot_rwlock(int argl, void* args)
+{
+  rwlock_args* A = args;
+  rwlock_state* S = malloc(sizeof(rwlock_state));
+  *S = (rwlock_state) { .rw = RWLOCK_INIT, .mx = MUTEX_INIT, .ops = A->ops, .mutex = A->mutex };
+  Tid_t tid[A->threads];
+
+  double start = wall_time();
+  for(int t=0; t<A->threads; t++)
+    tid[t] = CreateThread(rwlock_contender, t, S);
+  for(int t=0; t<A->threads; t++)
+    ThreadJoin(tid[t], NULL);
+  *A->elapsed = wall_time() - start;
+
+  free(S);
+  return 0;
+}
+
+static void bench_rwlock(uint maxcores, int ops)
+{
+  printf("%6s %16s %16s\n", "cores", "RWLock (ops/s)", "Mutex (ops/s)");
+  for(uint ncores=1; ncores<=maxcores; ncores*=2) {
+    double rate[2];
+    for(int mutex=0; mutex<2; mutex++) {
+      double elapsed;
+      rwlock_args A = { ncores, ops, mutex, &elapsed };
+      boot(ncores, 0, boot_rwlock, sizeof(A), &A);
+      rate[mutex] = (double)ops * ncores / elapsed;
+    }
+    printf("%6u %16.0f %16.0f\n", ncores, rate[0], rate[1]);
+  }
+}
+
+
+/****************************************************
+  Process info benchmark.
+
+  A monitor walks the process table through OpenInfo streams, while
+  one thread per core creates and reaps processes. Both the walk time 
+  and the Exec rate are reported.
+ ****************************************************/
+
+typedef struct procinfo_args {
+  int churners;
+  int walks;
+  double* walk_us;
+  double* execs;
+} procinfo_args;
+
+static int churn_child(int argl, void* args) { return 0; }
+
+static int churner(int argl, void* args)
+{
+  int* stop = args;
+  int n = 0;
+  while(! __atomic_load_n(stop, __ATOMIC_RELAXED)) {
+    Pid_t cpid = Exec(churn_child, 0, NULL);
+    if(cpid != NOPROC) WaitChild(cpid, NULL);
+    n++;
+  }
+  return n;
+}
+
+static int boot_procinfo(int argl, void* args)
+{
+  procinfo_args* A = args;
+  int stop = 0;
+  Tid_t tid[A->churners+1];
+  for(int t=0; t<A->churners; t++)
+    tid[t] = CreateThread(churner, 0, &stop);
+
+  double start = wall_time();
+  procinfo info;
+  for(int w=0; w<A->walks; w++) {
+    Fid_t finfo = OpenInfo();
+    while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info));
+    Close(finfo);
+  }
+  double elapsed = wall_time() - start;
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+  int execs = 0;
+  for(int t=0; t<A->churners; t++) {
+    int n;
+    ThreadJoin(tid[t], &n);
+    execs += n;
+  }
+  *A->walk_us = elapsed * 1e6 / A->walks;
+  *A->execs = execs / elapsed;
+  return 0;
+}
+
+static void bench_procinfo(uint maxcores, int walks)
+{
+  printf("%6s %12s %16s %12s\n", "cores", "churners", "walk (usec)", "Exec/s");
+  for(uint ncores=1; ncores<=maxcores; ncores*=2) {
+    for(int churners=0; churners<=(int)ncores; churners+=ncores) {
+      double walk_us, execs;
+      procinfo_args A = { churners, walks, &walk_us, &execs };
+      boot(ncores, 0, boot_procinfo, sizeof(A), &A);
+      printf("%6u %12d %16.2f %12.0f\n", ncores, churners, walk_us, execs);
+    }
+  }
+}
+
+
+/****************************************************
+  Timer benchmark.
+
+  Register many timeouts, as sleeping threads do, then cancel or 
+  expire them. The timer wheel of the scheduler is compared to a 
+  sorted list. This does not boot the VM.
+ ****************************************************/
+
+typedef struct list_timer {
+  rlnode node;
+  TimerDuration when;
+} list_timer;
+
+static void bench_timers(int n)
+{
+  timer_node* T = malloc(n*sizeof(timer_node));
+  list_timer* LT = malloc(n*sizeof(list_timer));
+  TimerDuration* when = malloc(n*sizeof(TimerDuration));
+
+  /* Timeouts within the next 10 seconds */
+  srand(1);
+  for(int i=0; i<n; i++) when[i] = rand() % 10000000;
+
+  printf("%12s %8s %14s %14s %14s\n", "structure", "timers", "add (ns/op)", "cancel (ns/op)", "expire (ns/op)");
+
+  /* The timer wheel */
+  {
+    timer_wheel tw;
+    timer_wheel_init(&tw, 0);
+    double t0 = wall_time();
+    for(int i=0; i<n; i++)
+      timer_add(&tw, timer_node_init(T+i, NULL), when[i]);
+    double t1 = wall_time();
+    for(int i=0; i<n; i+=2)
+      timer_cancel(&tw, T+i);
+    double t2 = wall_time();
+    rlnode L;  rlnode_init(&L, NULL);
+    for(TimerDuration now=0; now <= 10000000; now += QUANTUM)
+      timer_expire(&tw, now, &L);
+    double t3 = wall_time();
+    assert(tw.count==0 && rlist_len(&L)==n/2);
+
+    printf("%12s %8d %14.1f %14.1f %14.1f\n", "wheel", n, 
+      (t1-t0)*1E9/n, (t2-t1)*1E9/((n+1)/2), (t3-t2)*1E9/(n/2));
+  }
+
+  /* A sorted list, as the scheduler used to have. Insertion is 
+     quadratic, so the list gets fewer timers. */
+  {
+    int m = (n < 20000) ? n : 20000;
+    rlnode TL;  rlnode_init(&TL, NULL);
+    double t0 = wall_time();
+    for(int i=0; i<m; i++) {
+      rlnode_init(&LT[i].node, &LT[i]);
+      LT[i].when = when[i];
+      rlnode* p = TL.next;
+      for(; p!=&TL; p=p->next)
+        if(LT[i].when < ((list_timer*)p)->when) break;
+      rl_splice(p->prev, &LT[i].node);
+    }
+    double t1 = wall_time();
+    for(int i=0; i<m; i+=2)
+      rlist_remove(&LT[i].node);
+    double t2 = wall_time();
+    for(TimerDuration now=0; now <= 10000000; now += QUANTUM)
+      while(!is_rlist_empty(&TL) && ((list_timer*)TL.next)->when <= now)
+        rlist_pop_front(&TL);
+    double t3 = wall_time();
+
+    printf("%12s %8d %14.1f %14.1f %14.1f\n", "sorted list", m,
+      (t1-t0)*1E9/m, (t2-t1)*1E9/((m+1)/2), (t3-t2)*1E9/(m/2));
+  }
+
+  free(T);
+  free(LT);
+  free(when);
+}
+
+
+/****************************************************
+  Timer jitter benchmark.
+
+  A bare VM (without the kernel) on one core sets its timer for 1 msec,
+  again and again, and measures how late the ALARM interrupt comes. 
+  The core either spins, so that the ALARM preempts it, or halts.
+ ****************************************************/
+
+static struct {
+  int rounds, busy;
+  volatile int count;
+  double due;
+  double total, max;
+  unsigned long hist[LAT_BUCKETS];
+} J;
+
+static void jitter_alarm()
+{
+  double late = wall_time() - J.due;
+  J.total += late;
+  if(late > J.max) J.max = late;
+  int b = 0;
+  while(b < LAT_BUCKETS-1 && late*1E6 >= (1 << b)) b++;
+  J.hist[b]++;
+
+  if(++J.count < J.rounds) {
+    J.due = wall_time() + 1E-3;
+    bios_set_timer(1000);
+  }
+}
+
+static void jitter_boot()
+{
+  cpu_interrupt_handler(ALARM, jitter_alarm);
+  J.due = wall_time() + 1E-3;
+  bios_set_timer(1000);
+  while(J.count < J.rounds)
+    if(! J.busy) cpu_core_halt();
+  cpu_interrupt_handler(ALARM, NULL);
+}
+
+static void bench_jitter(int rounds)
+{
+  printf("%8s", "core");
+  for(int b=0; b<LAT_BUCKETS-1; b++) {
+    char label[16];
+    snprintf(label, sizeof(label), "<%d", 1 << b);
+    printf(" %7s", label);
+  }
+  printf(" %7s %10s %10s\n", "more", "mean (usec)", "max (usec)");
+
+  const char* modes[] = { "halted", "busy" };
+  for(int busy=0; busy<2; busy++) {
+    memset(&J, 0, sizeof(J));
+    J.rounds = rounds;
+    J.busy = busy;
+    vm_boot(jitter_boot, 1, 0);
+    printf("%8s", modes[busy]);
+    for(int b=0; b<LAT_BUCKETS; b++)
+      printf(" %7lu", J.hist[b]);
+    printf(" %10.1f %10.1f\n", J.total*1E6/rounds, J.max*1E6);
+  }
+}
+
+
+/****************************************************/
+
+void usage(const char* pname)
+{
+  printf("usage:\n  %s <mode> [<args>]\n\n\
+  where <mode> is one of:\n\
+    ctxswitch [<maxcores>] [<rounds>]\n\
+        pairs of threads ping-pong over a condition variable,\n\
+        on 1 up to <maxcores> cores (default 4), for <rounds> rounds (default 20000)\n\
+    swap [<rounds>]\n\
+        two contexts switch back and forth <rounds> times (default 1000000),\n\
+        by cpu_swap_context() and by swapcontext(3), without the scheduler\n\
+    spawn [<maxcores>] [<threads>]\n\
+        on 1 up to <maxcores> cores (default 4), each core creates and joins\n\
+        <threads> threads (default 20000), one at a time\n\
+    pipeline [<maxcores>] [<stages>] [<mbytes>]\n\
+        on 1 up to <maxcores> cores (default 4), pass <mbytes> Mbytes (default 64)\n\
+        through a chain of <stages> threads (default 4) connected by bounded buffers\n\
+    stacks [<threads>]\n\
+        create <threads> blocked threads (default 10000) with various stack\n\
+        sizes, and report the resident memory per thread\n\
+    latency [<maxcores>] [<rounds>]\n\
+        on 1 up to <maxcores> cores (default 4), CPU-bound threads wake up a\n\
+        responder thread <rounds> times (default 1000), and its wakeup latency\n\
+        is reported, at the default and at the highest priority\n\
+    wakeup [<rounds>]\n\
+        on 2 cores, a thread wakes up a responder <rounds> times\n\
+        (default 1000) on a halted core, and the histogram of its wakeup latency\n\
+        is reported, with halted cores waiting for a signal and on a futex\n\
+    syscall [<maxcores>] [<calls>]\n\
+        on 1 up to <maxcores> cores (default 4), as many threads each\n\
+        Write() to a null stream <calls> times (default 1000000)\n\
+    symposium [<maxcores>] [<diners>] [<bites>]\n\
+        on 1 up to <maxcores> cores (default 4), <diners> philosophers (default 200)\n\
+        eat <bites> times each (default 20); the waits to lock the table are reported\n\
+    broadcast [<maxcores>] [<waiters>] [<rounds>]\n\
+        on 1 up to <maxcores> cores (default 4), <waiters> threads (default 100)\n\
+        wait on a condition variable, and are woken up by a broadcast, <rounds>\n\
+        times (default 2000)\n\
+    spinlock [<maxcores>] [<ops>]\n\
+        on 1, 2, 4, ... up to <maxcores> cores (default 32), as many threads\n\
+        lock a Spinlock and an McsLock <ops> times each (default 100000)\n\
+    rwlock [<maxcores>] [<ops>]\n\
+        on 1, 2, 4, ... up to <maxcores> cores (default 32), as many threads\n\
+        read a shared table <ops> times each (default 1000000), writing it once\n\
+        every 100 times, under a RWLock and under a Mutex\n\
+    procinfo [<maxcores>] [<walks>]\n\
+        on 1, 2, 4, ... up to <maxcores> cores (default 4), walk the process\n\
+        table <walks> times (default 100) by OpenInfo, with and without as\n\
+        many threads creating and reaping processes\n\
+    jitter [<rounds>]\n\
+        without the kernel, a core sets its timer for 1 msec <rounds> times\n\
+        (default 1000), and the histogram of the ALARM lateness is reported,\n\
+        with the core halted and with the core busy\n\
+    timers [<n>]\n\
+        register <n> timeouts (default 100000) with the scheduler's timer wheel\n\
+        and with a sorted list, then cancel half and expire the rest\n",
+	 pname);
+  exit(1);
+}
+
+
+int main(int argc, const char** argv)
+{
+  if(argc < 2) usage(argv[0]);
+
+  if(strcmp(argv[1], "ctxswitch")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int rounds = (argc>3) ? atoi(argv[3]) : 20000;
+    if(maxcores<1 || maxcores>MAX_CORES || rounds<1) usage(argv[0]);
+    bench_ctxswitch(maxcores, rounds);
+  }
+  else if(strcmp(argv[1], "swap")==0) {
+    int rounds = (argc>2) ? atoi(argv[2]) : 1000000;
+    if(rounds<1) usage(argv[0]);
+    bench_swap(rounds);
+  }
+  else if(strcmp(argv[1], "spawn")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int threads = (argc>3) ? atoi(argv[3]) : 20000;
+    if(maxcores<1 || maxcores>MAX_CORES || threads<1) usage(argv[0]);
+    bench_spawn(maxcores, threads);
+  }
+  else if(strcmp(argv[1], "pipeline")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int stages = (argc>3) ? atoi(argv[3]) : 4;
+    int mbytes = (argc>4) ? atoi(argv[4]) : 64;
+    if(maxcores<1 || maxcores>MAX_CORES || stages<0 || mbytes<1) usage(argv[0]);
+    bench_pipeline(maxcores, stages, mbytes);
+  }
+  else if(strcmp(argv[1], "stacks")==0) {
+    int threads = (argc>2) ? atoi(argv[2]) : 10000;
+    if(threads<1) usage(argv[0]);
+    bench_stacks(threads);
+  }
+  else if(strcmp(argv[1], "latency")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int rounds = (argc>3) ? atoi(argv[3]) : 1000;
+    if(maxcores<1 || maxcores>MAX_CORES || rounds<1) usage(argv[0]);
+    bench_latency(maxcores, rounds);
+  }
+  else if(strcmp(argv[1], "wakeup")==0) {
+    int rounds = (argc>2) ? atoi(argv[2]) : 1000;
+    if(rounds<1) usage(argv[0]);
+    bench_wakeup(rounds);
+  }
+  else if(strcmp(argv[1], "syscall")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int calls = (argc>3) ? atoi(argv[3]) : 1000000;
+    if(maxcores<1 || maxcores>MAX_CORES || calls<1) usage(argv[0]);
+    bench_syscall(maxcores, calls);
+  }
+  else if(strcmp(argv[1], "symposium")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int diners = (argc>3) ? atoi(argv[3]) : 200;
+    int bites = (argc>4) ? atoi(argv[4]) : 20;
+    if(maxcores<1 || maxcores>MAX_CORES || diners<2 || bites<1) usage(argv[0]);
+    bench_symposium(maxcores, diners, bites);
+  }
+  else if(strcmp(argv[1], "broadcast")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int waiters = (argc>3) ? atoi(argv[3]) : 100;
+    int rounds = (argc>4) ? atoi(argv[4]) : 2000;
+    if(maxcores<1 || maxcores>MAX_CORES || waiters<1 || rounds<1) usage(argv[0]);
+    bench_broadcast(maxcores, waiters, rounds);
+  }
+  else if(strcmp(argv[1], "spinlock")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 32;
+    int ops = (argc>3) ? atoi(argv[3]) : 100000;
+    if(maxcores<1 || maxcores>MAX_CORES || ops<1) usage(argv[0]);
+    bench_spinlock(maxcores, ops);
+  }
+  else if(strcmp(argv[1], "rwlock")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 32;
+    int ops = (argc>3) ? atoi(argv[3]) : 1000000;
+    if(maxcores<1 || maxcores>MAX_CORES || ops<1) usage(argv[0]);
+    bench_rwlock(maxcores, ops);
+  }
+  else if(strcmp(argv[1], "procinfo")==0) {
+    uint maxcores = (argc>2) ? atoi(argv[2]) : 4;
+    int walks = (argc>3) ? atoi(argv[3]) : 100;
+    if(maxcores<1 || maxcores>MAX_CORES || walks<1) usage(argv[0]);
+    bench_procinfo(maxcores, walks);
+  }
+  else if(strcmp(argv[1], "jitter")==0) {
+    int rounds = (argc>2) ? atoi(argv[2]) : 1000;
+    if(rounds<1) usage(argv[0]);
+    bench_jitter(rounds);
+  }
+  else if(strcmp(argv[1], "timers")==0) {
+    int n = (argc>2) ? atoi(argv[2]) : 100000;
+    if(n<2) usage(argv[0]);
+    bench_timers(n);
+  }
+  else
+    usage(argv[0]);
+
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include <time.h>
 #include <setjmp.h>
 #include "util.h"
+#include "kernel_timer.h"
 
 #include "unit_testing.h"
 
@@ -128,7 +129,9 @@ BARE_TEST(test_list_queue,
 	while(! is_rlist_empty(&L)) {
 		rlnode* p = rlist_pop_back(&L);
 		ASSERT(I==p);
+		ASSERT(p->next==p && p->prev==p);
 		I++;
+		ASSERT(rlist_len(&L)==10-(I-n));
 	}
 
 	ASSERT(is_rlist_empty(&L));
@@ -268,6 +271,126 @@ TEST_SUITE(rlist_tests,
 
 
 
+/* Unit tests for the timer wheel */
+
+BARE_TEST(test_timer_expire,
+	"Test that timers expire on time, in spite of cancellations and cascading"
+	)
+{
+	enum { N = 3000 };
+	static timer_node T[N];
+	static int fired[N];
+	timer_wheel tw;
+
+	TimerDuration now = 123456;
+	timer_wheel_init(&tw, now);
+
+	srand(17);
+	for(int i=0; i<N; i++) {
+		timer_node_init(T+i, T+i);
+		fired[i] = 0;
+		/* Mostly within 100 sec, but a few are hours away */
+		TimerDuration delay = (i%100==0) ? 5000000000ul + rand() : (TimerDuration)rand() % 100000000ul;
+		timer_add(&tw, T+i, now+delay);
+	}
+	ASSERT(tw.count == N);
+
+	/* Cancel some */
+	for(int i=0; i<N; i+=7) {
+		timer_cancel(&tw, T+i);
+		ASSERT(! timer_is_armed(T+i));
+	}
+
+	TimerDuration deadline = now + 8000000000ul;
+	while(now < deadline) {
+		/* The lower bound must be respected */
+		TimerDuration next = timer_next(&tw);
+		for(int i=0; i<N; i++)
+			if(timer_is_armed(T+i)) ASSERT(next <= T[i].when);
+
+		now += (now < 123456 + 110000000ul) ? rand() % 50000 : rand() % 100000000ul;
+
+		rlnode L;  rlnode_init(&L, NULL);
+		timer_expire(&tw, now, &L);
+
+		while(! is_rlist_empty(&L)) {
+			timer_node* t = rlist_pop_front(&L)->obj;
+			ASSERT(t->when <= now);
+			fired[t-T]++;
+		}
+
+		for(int i=0; i<N; i++)
+			if(timer_is_armed(T+i)) ASSERT(T[i].when > now);
+	}
+
+	ASSERT(tw.count == 0);
+	for(int i=0; i<N; i++)
+		ASSERT(fired[i] == ((i%7==0) ? 0 : 1));
+}
+
+
+BARE_TEST(test_timer_past,
+	"Test that a timer added in the past expires on the next call"
+	)
+{
+	timer_wheel tw;
+	timer_node t;
+	timer_wheel_init(&tw, 1000000);
+	timer_node_init(&t, NULL);
+
+	rlnode L;  rlnode_init(&L, NULL);
+	timer_expire(&tw, 2000000, &L);
+	ASSERT(is_rlist_empty(&L));
+	ASSERT(timer_next(&tw) == (TimerDuration)-1);
+
+	timer_add(&tw, &t, 1500000);
+	ASSERT(timer_next(&tw) <= 1500000);
+	timer_expire(&tw, 2000000, &L);
+	ASSERT(L.next == &t.node && rlist_len(&L)==1);
+	ASSERT(tw.count == 0);
+}
+
+
+BARE_TEST(test_timer_long_gap,
+	"Test that a timer far in the future expires exactly on time, when the wheel "
+	"is advanced in a single step"
+	)
+{
+	/* From 2 msec to about 10 hours away */
+	TimerDuration delays[] = { 2000, 65000, 4100000, 262000000, 3600000000ul, 36000000000ul };
+	enum { N = sizeof(delays)/sizeof(delays[0]) };
+
+	for(int i=0; i<N; i++) {
+		timer_wheel tw;
+		timer_node t;
+		TimerDuration now = 777777;
+		timer_wheel_init(&tw, now);
+		timer_node_init(&t, NULL);
+		timer_add(&tw, &t, now+delays[i]);
+
+		rlnode L;  rlnode_init(&L, NULL);
+		timer_expire(&tw, now+delays[i]-1, &L);
+		ASSERT(is_rlist_empty(&L) && timer_is_armed(&t));
+		ASSERT(timer_next(&tw) <= now+delays[i]);
+
+		timer_expire(&tw, now+delays[i], &L);
+		ASSERT(L.next == &t.node && rlist_len(&L)==1);
+		ASSERT(tw.count == 0);
+	}
+}
+
+
+TEST_SUITE(timer_tests,
+	"Tests for the timer wheel")
+{
+	&test_timer_expire,
+	&test_timer_past,
+	&test_timer_long_gap,
+	NULL
+};
+
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -321,6 +444,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&timer_tests,
 	&test_pack_unpack,
 	NULL
 };
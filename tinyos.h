@@ -3,6 +3,7 @@
 #define __TINYOS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
   @file tinyos.h
@@ -66,17 +67,65 @@ typedef uintptr_t Tid_t;
  *      Concurrency control
  *******************************************/
 
+/** @brief A spinlock.
+
+    Spinlocks protect very short critical sections in the kernel, such as the 
+    thread arena and the device drivers, and they can be used in both the
+    preemptive and the non-preemptive domain. A thread waiting for a spinlock
+    spins; in the preemptive domain, it yields after spinning for a while.
+    User programs should use @c Mutex instead.
+
+    @see SPINLOCK_INIT
+ */
+typedef char Spinlock;
+
+/** @brief This macro is used to initialize spinlocks. */
+#define SPINLOCK_INIT 0
+
+/** @brief A queue spinlock (MCS lock).
+
+    Threads waiting for a queue spinlock are queued in FIFO order, and each
+    spins on a queue node of its own core; only the first of them spins on 
+    the lock itself. These locks protect the internals of mutexes and 
+    condition variables, and the scheduler. They are only taken in the 
+    non-preemptive domain of the kernel.
+
+    @see MCS_LOCK_INIT
+ */
+typedef struct {
+  char locked;              /**< Set while the lock is held */
+  struct mcs_node* tail;    /**< The last waiter in the queue, or NULL */
+} McsLock;
+
+/** @brief This macro is used to initialize queue spinlocks. */
+#define MCS_LOCK_INIT { 0, NULL }
+
+
 /** @brief A mutex is used to provide mutual exclusion. 
   
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation 
-    of the kernel.
+    of the kernel (in the preemptive domain).
+
+    A mutex is adaptive: a thread that finds it locked spins only while 
+    the owner is running on another core; else, it sleeps in the wait
+    queue of the mutex. When a mutex with waiters is unlocked, the first
+    waiter is woken up; a waiter that has waited for too long is handed
+    the mutex directly, so that waiters are not starved.
 
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  uintptr_t owner;      /**< The owner thread, or 0. Bit 0 is set if there are waiters */
+  void* waitq;          /**< The queue of waiting threads */
+  McsLock waitq_lock;   /**< A queue spinlock to protect `waitq` */
+#if defined(LOCK_PROFILING)
+  void* prof;           /**< The profile entry of the current holder */
+  uint64_t prof_since;  /**< The time the current holder locked the mutex */
+#endif
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,24 +135,24 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ .owner = 0, .waitq = NULL, .waitq_lock = MCS_LOCK_INIT })
 
 
 /** @brief Lock a mutex.
 
-  Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  Lock a mutex, by waiting if necessary, as long as it takes. The caller spins
+  for a while if the owner is running on another core, and sleeps otherwise.
+  This must not be called in the non-preemptive domain.
 
   @see Mutex
   @see Mutex_Unlock
-  @see set_core_preemption
   */
 void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If there are waiting threads, the first
+    of them is woken up, and it may be handed the mutex.
     @see Mutex
     @see Mutex_Lock
 */
@@ -121,8 +170,8 @@ void Mutex_Unlock(Mutex*);
   @see COND_INIT
  */
 typedef struct {
-  void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  void *waitset;          /**< The set of waiting threads */
+  McsLock waitset_lock;   /**< A queue spinlock to protect `waitset` */
 } CondVar;
 
 
@@ -133,7 +182,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, MCS_LOCK_INIT })
 
 
 /** @brief Wait on a condition variable. 
@@ -199,7 +248,142 @@ void Cond_Signal(CondVar*);
   @see Cond_Wait
   @see Cond_Signal
 */
-void Cond_Broadcast(CondVar*); 
+void Cond_Broadcast(CondVar*);
+
+
+/** @brief The number of reader counters of a reader-writer lock.
+
+  This must not be less than the maximum number of cores.
+ */
+#define RWLOCK_SLOTS 32
+
+/** @brief A reader-writer lock.
+
+  A reader-writer lock is held either by any number of readers, or by a
+  single writer. It is meant for read-mostly data.
+
+  Each core has its own reader counter, on a cache line of its own. So,
+  readers that find no writer only touch the counter of their core, and
+  they do not contend with each other. A writer announces itself first,
+  and then waits for the readers to leave. Readers that arrive while a
+  writer is waiting, or is holding the lock, wait for it; thus writers
+  are preferred, and they are not starved by readers.
+
+  These locks can be used in user-space, as well as in the preemptive
+  domain of the kernel. Note that a reader-writer lock is large, so it
+  should be used for shared tables and the like.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLock_Unlock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  struct {
+    long count;         /**< The readers that entered on this core, minus those that left */
+  } __attribute__((aligned(64))) readers[RWLOCK_SLOTS];  /**< The reader counters */
+  uintptr_t writer;     /**< The writer holding or waiting for the lock, or 0 */
+  Mutex mx;             /**< Protects the slow paths */
+  CondVar writer_done;  /**< Signalled when the writer leaves */
+  CondVar readers_done; /**< Signalled to the writer when readers leave */
+} RWLock;
+
+/** @brief This macro is used to initialize reader-writer locks.
+
+   It is used as follows:
+  @code
+  RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ .writer = 0, .mx = MUTEX_INIT, \
+    .writer_done = COND_INIT, .readers_done = COND_INIT })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  The caller waits as long as a writer holds the lock, or waits for it.
+  A thread that holds the lock for reading must not lock it again, since
+  a writer may be waiting.
+
+  @see RWLock
+  @see RWLock_Unlock
+ */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  The caller waits for the current writer, if any, and then for all
+  readers to leave.
+
+  @see RWLock
+  @see RWLock_Unlock
+ */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that you locked.
+
+  This releases the lock, whether it was locked for reading or for writing.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+ */
+void RWLock_Unlock(RWLock* rw);
+
+
+/** @brief A timeout that never expires.
+
+  @see WaitOnAddress
+ */
+#define WAIT_FOREVER ((timeout_t)-1)
+
+/** @brief Wait until a word changes.
+
+  All processes share the same address space, so any word of memory can
+  be waited on. If the word at @c addr holds @c expected, the caller
+  sleeps until another thread calls @c WakeAddress on it, or the timeout
+  expires. The check and the sleep are atomic with respect to
+  @c WakeAddress. Else, the call returns at once.
+
+  This is a building block for synchronization in user space: a lock or
+  a barrier keeps its state in a word, which threads update by atomic
+  instructions, and a thread only calls the kernel when it has to wait,
+  or to wake up waiters. Note that a thread may return without a change
+  of the word, so the caller should check the word again.
+
+  @param addr the word to wait on
+  @param expected the value of the word for which the caller waits
+  @param timeout the time to wait in milliseconds, or @c WAIT_FOREVER
+  @returns 1 if the caller was woken up by @c WakeAddress, 0 otherwise
+  @see WakeAddress
+ */
+int WaitOnAddress(int* addr, int expected, timeout_t timeout);
+
+/** @brief Wake up threads waiting on a word.
+
+  Wake up to @c n threads that wait on @c addr, in the order they
+  started waiting. The caller should change the word before this call.
+
+  @param addr the word waited on
+  @param n the maximum number of threads to wake up
+  @returns the number of threads woken up
+  @see WaitOnAddress
+ */
+int WakeAddress(int* addr, unsigned int n);
+
+
+#if defined(LOCK_PROFILING)
+/*
+  When the lock profiler is compiled in (see the Makefile), these calls 
+  also pass the name of the calling function, so that the contention is
+  reported per call site.
+ */
+void Mutex_Lock_at(Mutex* mx, const char* site);
+int Cond_Wait_at(Mutex* mx, CondVar* cv, const char* site);
+int Cond_TimedWait_at(Mutex* mx, CondVar* cv, timeout_t timeout, const char* site);
+
+#define Mutex_Lock(mx) Mutex_Lock_at((mx), __FUNCTION__)
+#define Cond_Wait(mx, cv) Cond_Wait_at((mx), (cv), __FUNCTION__)
+#define Cond_TimedWait(mx, cv, t) Cond_TimedWait_at((mx), (cv), (t), __FUNCTION__)
+#endif
 
 
 /*******************************************
@@ -319,11 +503,164 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is the same as `CreateThread`, except that the stack of the new
+  thread has (at least) `stack_size` bytes. The size is a hint: it is 
+  rounded up to a power of 2 times 16 kbytes, and it is capped at 8 Mbytes.
+  If `stack_size` is 0, the default stack size (128 kbytes) is used.
+
+  Stack memory is committed as it is used, so a large stack costs 
+  little, unless it is actually used. A stack overflow causes a 
+  segmentation fault.
+
+  @param task a function to execute
+  @param argl the first argument of `task`
+  @param args the second argument of `task`
+  @param stack_size the requested stack size, in bytes
+  @returns the Tid of the new thread, or NOTHREAD on error
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, size_t stack_size);
+
+/** @brief The highest static thread priority. */
+#define PRIORITY_HIGHEST 0
+
+/** @brief The lowest static thread priority. */
+#define PRIORITY_LOWEST 7
+
+/** @brief The static priority of the initial task. */
+#define PRIORITY_DEFAULT 4
+
+/** 
+  @brief Create a new thread in the current process, with a given priority.
+
+  This is the same as `CreateThread`, except that the new thread has
+  static priority `priority`, instead of the priority of the caller.
+
+  @param task a function to execute
+  @param argl the first argument of `task`
+  @param args the second argument of `task`
+  @param priority the static priority of the new thread
+  @returns the Tid of the new thread, or NOTHREAD if the priority is illegal
+  @see CreateThread
+  @see SetPriority
+  */
+Tid_t CreateThreadPriority(Task task, int argl, void* args, int priority);
+
 /**
   @brief Return the Tid of the current thread.
  */
 Tid_t ThreadSelf();
 
+/**
+  @brief Set the static priority of a thread.
+
+  Each thread has a static priority, between `PRIORITY_HIGHEST` (0) and
+  `PRIORITY_LOWEST` (7); a smaller number means a more important thread.
+  A new thread inherits the priority of the thread that created it; the 
+  initial task has priority `PRIORITY_DEFAULT`.
+
+  A thread never runs on a core while a thread of higher priority is ready 
+  to run there. When a thread of higher priority wakes up, it preempts a 
+  thread of lower priority without waiting for its time slice to expire.
+  Threads of equal priority share the cpu. Use high priorities for 
+  latency-critical threads that mostly sleep, since a busy thread of high 
+  priority can starve all threads below it.
+
+  The tid must refer to a thread of the calling process that has not 
+  exited. 
+
+  @param tid the thread
+  @param priority the new priority
+  @returns 0 on success, or -1 on error
+  @see GetPriority
+  */
+int SetPriority(Tid_t tid, int priority);
+
+/**
+  @brief Return the static priority of a thread.
+
+  The tid must refer to a thread of the calling process. The thread may
+  have exited, as long as it has not been joined or detached.
+
+  @param tid the thread
+  @returns the priority of the thread, or -1 on error
+  @see SetPriority
+  */
+int GetPriority(Tid_t tid);
+
+/**
+  @brief The parameters and statistics of a thread in the deadline class.
+
+  All times are in microseconds.
+  @see SetDeadline
+  @see GetDeadline
+ */
+typedef struct deadline_info {
+  unsigned long runtime;   /**< @brief The cpu time of each job */
+  unsigned long period;    /**< @brief The period of the jobs */
+  unsigned long deadline;  /**< @brief The deadline of each job, relative to its release */
+  unsigned long jobs;      /**< @brief The number of jobs completed */
+  unsigned long misses;    /**< @brief The number of jobs completed after their deadline */
+} deadline_info;
+
+/**
+  @brief Put a thread in the deadline (real-time) class.
+
+  A thread of the deadline class executes a sequence of jobs, one every
+  `period`. Each job needs (at most) `runtime` of cpu time, and must 
+  complete within `deadline` from the start of its period. A job ends 
+  when the thread calls `WaitPeriod`. All times are in microseconds, and
+  it must be that 0 < runtime <= deadline <= period. The first job starts
+  at once.
+
+  Deadline threads run ahead of all other threads, earliest deadline
+  first. A job that uses up its `runtime` continues as a normal thread,
+  and it will probably miss its deadline.
+
+  The kernel admits the thread to a core only if the deadline threads of
+  the core, including this one, need at most 90% of its time; i.e., the 
+  sum of runtime/period for these threads is at most 0.9. Else, the call
+  fails. 
+
+  If `runtime` is 0, the thread leaves the deadline class.
+
+  @param tid the thread, which must belong to the calling process and
+     must not have exited
+  @param runtime the cpu time of each job
+  @param period the period of the jobs
+  @param deadline the deadline of each job, relative to its release
+  @returns 0 on success, or -1 on error
+  @see WaitPeriod
+  @see GetDeadline
+ */
+int SetDeadline(Tid_t tid, unsigned long runtime, unsigned long period, unsigned long deadline);
+
+/**
+  @brief End the current job of a deadline thread.
+
+  The calling thread sleeps until the start of its next period. If the
+  current job completes after its deadline, it is counted as a miss.
+
+  @returns 0 on success, or -1 if the caller is not in the deadline class
+  @see SetDeadline
+ */
+int WaitPeriod();
+
+/**
+  @brief Return the deadline parameters and statistics of a thread.
+
+  @param tid the thread, which must belong to the calling process and
+     must not have exited
+  @param info the parameters and statistics are stored here
+  @returns 0 on success, or -1 on error or if the thread is not in the
+     deadline class
+  @see SetDeadline
+ */
+int GetDeadline(Tid_t tid, deadline_info* info);
+
 /**
   @brief Join the given thread.
 
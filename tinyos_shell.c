@@ -462,7 +462,8 @@ static int rsrv_listener_thread(int port, void* __globals)
 		} else {
 			GS(active_conn)++;
 			GS(total_conn)++;
-			Tid_t t = CreateThread(rsrv_client, sock, __globals);
+			/* Clients do not inherit the listener's priority */
+			Tid_t t = CreateThreadPriority(rsrv_client, sock, __globals, PRIORITY_DEFAULT);
 			ThreadDetach(t);
 		}
 	}
@@ -488,8 +489,9 @@ int RemoteServer(size_t argc, const char** argv)
 
 	log_init(__globals);
 
-	/* Start a thread to listen on */
-	GS(listener) = CreateThread(rsrv_listener_thread, GS(port), __globals);
+	/* Start a thread to listen on. It runs at high priority, so that 
+	   connections are accepted promptly, even when clients are busy. */
+	GS(listener) = CreateThreadPriority(rsrv_listener_thread, GS(port), __globals, PRIORITY_HIGHEST);
 	
 	/* Enter the server console */
 	char* linebuff = NULL;
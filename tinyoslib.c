@@ -172,22 +172,21 @@ int Execute(Program prog, size_t argc, const char** argv)
 void BarrierSync(barrier* bar, unsigned int n)
 {
 	assert(n>0);
-	Mutex_Lock(& bar->mx);
 
-	int epoch = bar->epoch;
-	assert(bar->count < n);
+	/* The epoch must be read before arriving; it cannot change until we do */
+	int epoch = __atomic_load_n(&bar->epoch, __ATOMIC_ACQUIRE);
+	unsigned int count = __atomic_add_fetch(&bar->count, 1, __ATOMIC_ACQ_REL);
+	assert(count <= n);
 
-	bar->count ++;
-	if(bar->count == n) {
-		bar->epoch ++;
-		bar->count = 0;
-		Cond_Broadcast(&bar->cv);
+	if(count == n) {
+		__atomic_store_n(&bar->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&bar->epoch, epoch+1, __ATOMIC_RELEASE);
+		WakeAddress(&bar->epoch, n-1);
+		return;
 	}
 
-	while(epoch == bar->epoch)
-		Cond_Wait(&bar->mx, &bar->cv);
-
-	Mutex_Unlock(& bar->mx);
+	while(__atomic_load_n(&bar->epoch, __ATOMIC_ACQUIRE) == epoch)
+		WaitOnAddress(&bar->epoch, epoch, WAIT_FOREVER);
 }
 
 
@@ -74,13 +74,19 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
 
+/**
+	@brief A reusable barrier.
+
+	The state of the barrier is kept in two words, which threads update
+	atomically. Only the threads that have to wait, and the last thread
+	to arrive, call the kernel, by @c WaitOnAddress and @c WakeAddress.
+  */
 typedef struct barrier {
-	Mutex mx;
-	CondVar cv;
-	unsigned int count, epoch;
+	unsigned int count;  /**< The threads that have arrived */
+	int epoch;           /**< Incremented when all threads have arrived */
 } barrier;
 
-#define BARRIER_INIT  ((barrier){ MUTEX_INIT, COND_INIT, 0, 0})
+#define BARRIER_INIT  ((barrier){ 0, 0 })
 
 
 void BarrierSync(barrier* bar, unsigned int n);
@@ -469,7 +469,7 @@ void sendme(uint term, const char* pattern)
    1 if it exited normally, 0 otherwise.
 
    When the subprocess starts, it runs terminal proxies
-   on each of the 4 terminals and makes them available to test
+   on each of the terminals and makes them available to test
    code.
 
    The subprocess will be killed after 'timeout' seconds, if it
@@ -835,6 +835,8 @@ static struct argp_option options [] = {
 	{"list", 'l', 0, 0, "Show a list of available tests" },
 	{"verbose", 'v', 0, 0, "Be verbose: show test descriptions"},
 	{"nocolor", 'n', 0, 0, "Do not color the output"},
+	{"virtual-time", 'T', 0, 0, "Run the VM in virtual time (skip idle time)"},
+	{"halt-futex", 'H', 0, 0, "Halted cores of the VM wait on a futex, not a signal"},
 	{ NULL }
 };
 
@@ -930,6 +932,14 @@ parse_options(int key, char *arg, struct argp_state *state)
 			ARGS.use_color = 0;
 			break;
 
+		case 'T':
+			setenv("TINYOS_VIRTUAL_TIME", "1", 1);
+			break;
+
+		case 'H':
+			setenv("TINYOS_HALT_FUTEX", "1", 1);
+			break;
+
 		case 'F':
 			ARGS.fork = 1;
 			break;
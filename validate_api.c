@@ -356,6 +356,123 @@ BOOT_TEST(test_orphans_adopted_by_init,
 }
 
 
+static int info_child(int argl, void* args)
+{
+	int* flag = *(int**) args;
+	while(*flag == 0)
+		WaitOnAddress(flag, 0, WAIT_FOREVER);
+	return 42;
+}
+
+/* Read the info record of pid, returning 1 if found */
+static int find_procinfo(Pid_t pid, procinfo* info)
+{
+	int found = 0;
+	Fid_t finfo = OpenInfo();
+	if(finfo == NOFILE) return 0;
+	while(Read(finfo, (char*) info, sizeof(procinfo)) == sizeof(procinfo))
+		if(info->pid == pid) { found = 1; break; }
+	Close(finfo);
+	return found;
+}
+
+BOOT_TEST(test_open_info,
+	"Test that the OpenInfo stream reports the processes, their parents,\n"
+	"state and arguments."
+	)
+{
+	procinfo info;
+
+	ASSERT(find_procinfo(1, &info));
+	ASSERT(info.ppid == NOPROC);
+	ASSERT(info.alive);
+	ASSERT(info.thread_count == 1);
+
+	int flag = 0;
+	int* arg = &flag;
+	Pid_t cpid = Exec(info_child, sizeof(arg), &arg);
+	ASSERT(cpid != NOPROC);
+
+	ASSERT(find_procinfo(cpid, &info));
+	ASSERT(info.ppid == 1);
+	ASSERT(info.alive);
+	ASSERT(info.main_task == info_child);
+	ASSERT(info.argl == sizeof(arg));
+	ASSERT(memcmp(info.args, &arg, sizeof(arg)) == 0);
+
+	/* Let the child exit, and see it become a zombie */
+	flag = 1;
+	WakeAddress(&flag, 1);
+	while(find_procinfo(cpid, &info) && info.alive)
+		fibo(10);
+	ASSERT(find_procinfo(cpid, &info));
+	ASSERT(! info.alive);
+
+	int status;
+	ASSERT(WaitChild(cpid, &status) == cpid);
+	ASSERT(status == 42);
+	ASSERT(! find_procinfo(cpid, &info));
+
+	/* Short reads and writes are errors */
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+	ASSERT(Read(finfo, (char*) &info, sizeof(info)-1) == -1);
+	ASSERT(Write(finfo, (char*) &info, sizeof(info)) == -1);
+	ASSERT(Close(finfo) == 0);
+	return 0;
+}
+
+
+static int churn_child(int argl, void* args) { return 0; }
+
+static int churn_task(int argl, void* args)
+{
+	int* done = args;
+	for(int i=0; i<1000; i++) {
+		Pid_t cpid = Exec(churn_child, 0, NULL);
+		if(cpid != NOPROC) WaitChild(cpid, NULL);
+	}
+	*done = 1;
+	return 0;
+}
+
+BOOT_TEST(test_open_info_churn,
+	"Test that the OpenInfo stream returns consistent records, while processes\n"
+	"are created and destroyed concurrently."
+	)
+{
+	int done = 0;
+	Tid_t t = CreateThread(churn_task, 0, &done);
+	ASSERT(t != NOTHREAD);
+
+	do {
+		Fid_t finfo = OpenInfo();
+		ASSERT(finfo != NOFILE);
+		procinfo info;
+		Pid_t last = NOPROC;
+		int seen_init = 0;
+		while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info)) {
+			ASSERT(info.pid > last && info.pid < MAX_PROC);
+			last = info.pid;
+			if(info.pid == 1) {
+				seen_init = 1;
+				ASSERT(info.alive);
+			}
+			else if(info.pid > 1) {
+				ASSERT(info.ppid == 1);
+				ASSERT(info.main_task == churn_child);
+				ASSERT(info.argl == 0);
+			}
+		}
+		ASSERT(seen_init);
+		ASSERT(Close(finfo) == 0);
+	} while(! __atomic_load_n(&done, __ATOMIC_ACQUIRE));
+
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -372,11 +489,6 @@ BOOT_TEST(test_orphans_adopted_by_init,
 	Test that a timed wait on a condition variable terminates after the timeout.
  */
 
-static unsigned long tspec2msec(struct timespec t)
-{
-	return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
-}
-
 
 static int do_timeout(int argl, void* args) {
 	timeout_t t = *((timeout_t *) args);
@@ -384,15 +496,15 @@ static int do_timeout(int argl, void* args) {
 	Mutex mx = MUTEX_INIT;
 	CondVar cv = COND_INIT;
 
-	struct timespec t1, t2;
-	clock_gettime(CLOCK_REALTIME, &t1);
+	/* Use the VM clock, which may run in virtual time */
+	TimerDuration t1 = bios_clock();
 
 	Mutex_Lock(&mx);
 	Cond_TimedWait(&mx, &cv, t);
 
-	clock_gettime(CLOCK_REALTIME, &t2);
+	TimerDuration t2 = bios_clock();
 
-	unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+	unsigned long Dt = (t2-t1)/1000ul;
 
 	/* Allow a large, 20% error */
 	ASSERT(abs(Dt-t)*5 <= Dt);
@@ -510,6 +622,186 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+struct broadcast_args {
+	Mutex m;
+	CondVar cv, pcv;
+	int waiting, open, signalled;
+};
+
+static int broadcast_waiter(int argl, void* args)
+{
+	struct broadcast_args* A = args;
+	Mutex_Lock(&A->m);
+	A->waiting++;
+	Cond_Signal(&A->pcv);
+	while(! A->open)
+		A->signalled += Cond_Wait(&A->m, &A->cv);
+	A->waiting--;
+	Mutex_Unlock(&A->m);
+	return 0;
+}
+
+BOOT_TEST(test_cond_broadcast_mutex,
+	"Test that a broadcast wakes up all the threads waiting on a condition variable, "
+	"with the mutex locked or not, and that each wait returns as signalled."
+	)
+{
+	const int N = 50;
+	struct broadcast_args A = { MUTEX_INIT, COND_INIT, COND_INIT, 0, 0, 0 };
+	Tid_t t[N];
+
+	for(int round = 0; round < 2; round++) {
+		A.open = 0;
+		A.signalled = 0;
+		for(int i=0; i<N; i++)
+			ASSERT((t[i] = CreateThread(broadcast_waiter, 0, &A)) != NOTHREAD);
+
+		Mutex_Lock(&A.m);
+		while(A.waiting != N) Cond_Wait(&A.m, &A.pcv);
+		A.open = 1;
+		/* In the first round, broadcast with the mutex locked */
+		if(round == 1) Mutex_Unlock(&A.m);
+		Cond_Broadcast(&A.cv);
+		if(round == 0) Mutex_Unlock(&A.m);
+
+		for(int i=0; i<N; i++)
+			ASSERT(ThreadJoin(t[i], NULL)==0);
+		ASSERT(A.waiting == 0);
+		ASSERT(A.signalled == N);
+	}
+	return 0;
+}
+
+
+/*
+	Test waiting on addresses.
+ */
+
+BOOT_TEST(test_wait_on_address_mismatch,
+	"Test that WaitOnAddress returns at once if the word does not hold the expected value, "
+	"and that WakeAddress without waiters wakes nobody."
+	)
+{
+	int w = 1;
+	ASSERT(WaitOnAddress(&w, 0, WAIT_FOREVER)==0);
+	ASSERT(WakeAddress(&w, 1)==0);
+	ASSERT(WakeAddress(&w, 0)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_wait_on_address_timeout,
+	"Test that WaitOnAddress returns after the timeout, if not woken up."
+	)
+{
+	int w = 0;
+
+	/* Use the VM clock, which may run in virtual time */
+	TimerDuration t1 = bios_clock();
+	ASSERT(WaitOnAddress(&w, 0, 500)==0);
+	unsigned long Dt = (bios_clock()-t1)/1000ul;
+
+	/* Allow a large, 20% error */
+	ASSERT_MSG(Dt >= 400, "WaitOnAddress returned after %lu msec\n", Dt);
+	return 0;
+}
+
+
+struct address_waiters {
+	int word;
+	int arrived;
+	int woken;
+};
+
+static int address_waiter(int argl, void* args)
+{
+	struct address_waiters* A = args;
+	__atomic_add_fetch(&A->arrived, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&A->word, __ATOMIC_SEQ_CST)==0)
+		if(WaitOnAddress(&A->word, 0, WAIT_FOREVER))
+			__atomic_add_fetch(&A->woken, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+BOOT_TEST(test_wake_address,
+	"Test that WakeAddress wakes up at most the requested number of waiters, "
+	"and that waiters wait until the word changes."
+	)
+{
+	const int N = 10;
+	struct address_waiters A = { 0, 0, 0 };
+	Tid_t t[N];
+
+	for(int i=0; i<N; i++) {
+		t[i] = CreateThread(address_waiter, 0, &A);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+
+	/* Let all threads go to sleep */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	while(__atomic_load_n(&A.arrived, __ATOMIC_SEQ_CST) < N)
+		Cond_TimedWait(&mx, &cv, 10);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	/* Woken threads find the word unchanged, and wait again */
+	ASSERT(WakeAddress(&A.word, 2)==2);
+
+	__atomic_store_n(&A.word, 1, __ATOMIC_SEQ_CST);
+	WakeAddress(&A.word, N);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(A.woken >= 2 && A.woken <= N+2);
+	return 0;
+}
+
+
+#define BARRIER_ROUNDS 100
+
+struct barrier_rounds {
+	barrier B;
+	unsigned int N;
+	int arrived[BARRIER_ROUNDS];
+	int errors;
+};
+
+static int barrier_rounds_task(int argl, void* args)
+{
+	struct barrier_rounds* R = args;
+	for(int r=0; r<BARRIER_ROUNDS; r++) {
+		__atomic_add_fetch(&R->arrived[r], 1, __ATOMIC_SEQ_CST);
+		BarrierSync(&R->B, R->N);
+		if(__atomic_load_n(&R->arrived[r], __ATOMIC_SEQ_CST) != R->N)
+			__atomic_add_fetch(&R->errors, 1, __ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_barrier_rounds,
+	"Test that a barrier, built on WaitOnAddress, can be used for many rounds."
+	)
+{
+	const unsigned int N = 8;
+	struct barrier_rounds R = { BARRIER_INIT, N, { 0 }, 0 };
+	Tid_t t[N];
+
+	for(unsigned int i=0; i<N; i++) {
+		t[i] = CreateThread(barrier_rounds_task, 0, &R);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+	for(unsigned int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(R.errors==0);
+	return 0;
+}
+
+#undef BARRIER_ROUNDS
+
+
+
 /*********************************************
  *
  *
@@ -603,6 +895,15 @@ BOOT_TEST(test_close_terminals,
 
 
 
+/* Seconds on the host's monotonic clock */
+static double wall_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+
 void checked_read(Fid_t fid, const char* message)
 {
 	int mlen = strlen(message);
@@ -649,6 +950,7 @@ BOOT_TEST(test_read_kbd_big,
 	char buffer[16384];
 	uint count = 0;
 	uint total = 1<<20;	
+	double start = wall_clock();
 	while(count < total)
 	{
 		int remain = total-count;
@@ -657,7 +959,9 @@ BOOT_TEST(test_read_kbd_big,
 		ASSERT(rc>0);
 		count += rc;
 	}
+	double elapsed = wall_clock() - start;
 
+	MSG("read %u bytes in %.3f sec (%.2f MB/s)\n", total, elapsed, total/elapsed/1E6);
 	return 0;
 }
 
@@ -842,6 +1146,7 @@ BOOT_TEST(test_write_con_big,
 	int total = 1<<20;
 	int count = 0;
 
+	double start = wall_clock();
 	while(count < total)
 	{
 		int remain = total-count;
@@ -850,7 +1155,9 @@ BOOT_TEST(test_write_con_big,
 		ASSERT(rc>0);
 		count += rc;
 	}
+	double elapsed = wall_clock() - start;
 
+	MSG("wrote %d bytes in %.3f sec (%.2f MB/s)\n", total, elapsed, total/elapsed/1E6);
 	return 0;
 }
 
@@ -923,9 +1230,16 @@ TEST_SUITE(basic_tests,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
 	&test_orphans_adopted_by_init,
+	&test_open_info,
+	&test_open_info_churn,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_mutex,
+	&test_wait_on_address_mismatch,
+	&test_wait_on_address_timeout,
+	&test_wake_address,
+	&test_barrier_rounds,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1077,6 +1391,257 @@ BOOT_TEST(test_create_join_thread,
 	return 0;
 }
 
+static int stack_user_task(int argl, void* args) {
+	/* Use argl bytes of stack */
+	volatile char buf[argl];
+	for(int i=0; i<argl; i+=1024) buf[i] = (char)i;
+	for(int i=0; i<argl; i+=1024) ASSERT(buf[i] == (char)i);
+	return argl;
+}
+
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads can be created with small and large stacks, and that "
+	"they can use most of their stack."
+	)
+{
+	struct { size_t stack_size; int used; } T[] = {
+		{ 0, 64*1024 },               /* default size */
+		{ 1, 8*1024 },                /* rounded up to the smallest size */
+		{ 1<<20, 900*1024 },
+		{ 3<<20, 3*1024*1024 },       /* rounded up to 4 Mbytes */
+		{ (size_t)1<<40, 6*1024*1024 }  /* capped */
+	};
+	const int N = sizeof(T)/sizeof(T[0]);
+
+	for(int i=0; i<N; i++) {
+		Tid_t t = CreateThreadStack(stack_user_task, T[i].used, NULL, T[i].stack_size);
+		ASSERT(t!=NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval==T[i].used);
+	}
+	return 0;
+}
+
+static int priority_task(int argl, void* args)
+{
+	return GetPriority(ThreadSelf());
+}
+
+BOOT_TEST(test_thread_priority,
+	"Test that thread priorities can be set and read, that they are inherited "
+	"by new threads, and that illegal calls fail."
+	)
+{
+	Tid_t self = ThreadSelf();
+	ASSERT(GetPriority(self)==PRIORITY_DEFAULT);
+
+	/* Set and get */
+	for(int p=PRIORITY_HIGHEST; p<=PRIORITY_LOWEST; p++) {
+		ASSERT(SetPriority(self, p)==0);
+		ASSERT(GetPriority(self)==p);
+	}
+
+	/* Illegal priorities and tids */
+	ASSERT(SetPriority(self, PRIORITY_HIGHEST-1)==-1);
+	ASSERT(SetPriority(self, PRIORITY_LOWEST+1)==-1);
+	ASSERT(GetPriority(self)==PRIORITY_LOWEST);
+	ASSERT(SetPriority(NOTHREAD, PRIORITY_DEFAULT)==-1);
+	ASSERT(GetPriority(NOTHREAD)==-1);
+	ASSERT(CreateThreadPriority(priority_task, 0, NULL, PRIORITY_LOWEST+1)==NOTHREAD);
+	ASSERT(CreateThreadPriority(priority_task, 0, NULL, -1)==NOTHREAD);
+
+	/* Inheritance */
+	ASSERT(SetPriority(self, 2)==0);
+	Tid_t t = CreateThread(priority_task, 0, NULL);
+	ASSERT(t!=NOTHREAD);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==2);
+
+	/* Explicit priority, readable after exit */
+	for(int p=PRIORITY_HIGHEST; p<=PRIORITY_LOWEST; p++) {
+		t = CreateThreadPriority(priority_task, 0, NULL, p);
+		ASSERT(t!=NOTHREAD);
+		ASSERT(GetPriority(t)==p);
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval==p);
+	}
+
+	/* A thread can be reprioritized by another thread, but not after it is joined */
+	t = CreateThreadPriority(priority_task, 0, NULL, PRIORITY_LOWEST);
+	if(SetPriority(t, PRIORITY_HIGHEST)==0)
+		ASSERT(GetPriority(t)==PRIORITY_HIGHEST);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(SetPriority(t, PRIORITY_LOWEST)==-1);
+
+	ASSERT(SetPriority(self, PRIORITY_DEFAULT)==0);
+	return 0;
+}
+
+typedef struct deadline_gate {
+	Mutex mx;
+	CondVar cv;
+	int open;
+} deadline_gate;
+
+static int deadline_gate_task(int argl, void* args)
+{
+	deadline_gate* G = args;
+	Mutex_Lock(&G->mx);
+	while(! G->open)
+		Cond_Wait(&G->mx, &G->cv);
+	Mutex_Unlock(&G->mx);
+	return 0;
+}
+
+static int raised_task(int argl, void* args)
+{
+	*(volatile int*) args = 1;
+	return 0;
+}
+
+BOOT_TEST(test_priority_raise_queued,
+	"Test that a queued thread whose priority is raised above that of the "
+	"current thread runs at once."
+	)
+{
+	volatile int ran = 0;
+	Tid_t t = CreateThreadPriority(raised_task, 0, (void*) &ran, PRIORITY_LOWEST);
+	ASSERT(t!=NOTHREAD);
+
+	/* On one core, the thread waits behind us, and preempts us when it
+	   is raised. On more cores, another core may run it. */
+	if(cpu_cores()==1)
+		ASSERT(ran==0);
+	ASSERT(SetPriority(t, PRIORITY_HIGHEST)==0);
+	if(cpu_cores()==1)
+		ASSERT(ran==1);
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ran==1);
+	return 0;
+}
+
+
+BOOT_TEST(test_deadline_admission,
+	"Test that the parameters of the deadline class are checked, that admission "
+	"control limits the utilization of each core, and that periodic jobs are counted."
+	)
+{
+	Tid_t self = ThreadSelf();
+	deadline_info info;
+
+	/* Illegal calls */
+	ASSERT(SetDeadline(self, 2000, 10000, 1000)==-1);
+	ASSERT(SetDeadline(self, 1000, 10000, 20000)==-1);
+	ASSERT(SetDeadline(NOTHREAD, 1000, 10000, 10000)==-1);
+	ASSERT(SetDeadline(self, 10000, 10000, 10000)==-1);  /* more than a core */
+	ASSERT(WaitPeriod()==-1);
+	ASSERT(GetDeadline(self, &info)==-1);
+
+	/* Load every core to one half */
+	uint ncores = cpu_cores();
+	deadline_gate G = { MUTEX_INIT, COND_INIT, 0 };
+	Tid_t t[ncores];
+	for(uint c=0; c<ncores; c++) {
+		t[c] = CreateThread(deadline_gate_task, 0, &G);
+		ASSERT(t[c]!=NOTHREAD);
+		ASSERT(SetDeadline(t[c], 5000, 10000, 10000)==0);
+	}
+	ASSERT(SetDeadline(self, 5000, 10000, 10000)==-1);
+	ASSERT(SetDeadline(self, 2000, 10000, 10000)==0);
+	ASSERT(SetDeadline(self, 5000, 10000, 10000)==-1);
+
+	/* Leaving the class frees its share */
+	ASSERT(SetDeadline(t[0], 0, 0, 0)==0);
+	ASSERT(GetDeadline(t[0], &info)==-1);
+	ASSERT(SetDeadline(self, 5000, 10000, 10000)==0);
+
+	Mutex_Lock(&G.mx);
+	G.open = 1;
+	Cond_Broadcast(&G.cv);
+	Mutex_Unlock(&G.mx);
+	for(uint c=0; c<ncores; c++)
+		ASSERT(ThreadJoin(t[c], NULL)==0);
+
+	/* Periodic jobs. The VM clock is used, since it may run in virtual time;
+	   it is coarse, so allow for its granularity. */
+	TimerDuration start = bios_clock();
+	ASSERT(SetDeadline(self, 2000, 10000, 10000)==0);
+	for(int j=0; j<5; j++)
+		ASSERT(WaitPeriod()==0);
+	double elapsed = 1E-6 * (bios_clock() - start);
+
+	ASSERT(GetDeadline(self, &info)==0);
+	ASSERT(info.runtime==2000 && info.period==10000 && info.deadline==10000);
+	ASSERT(info.jobs==5);
+	ASSERT_MSG(elapsed >= 0.040, "5 periods of 10 msec took %f sec\n", elapsed);
+
+	ASSERT(SetDeadline(self, 0, 0, 0)==0);
+	ASSERT(GetDeadline(self, &info)==-1);
+	return 0;
+}
+
+#define DEADLINE_JOBS 100
+
+/* A periodic thread: 1 msec of work every 10 msec, with a runtime budget of
+   3 msec and an implicit deadline. It returns its misses. */
+static int deadline_periodic_task(int argl, void* args)
+{
+	if(SetDeadline(ThreadSelf(), 3000, 10000, 10000)!=0)
+		return -1;
+
+	for(int j=0; j<DEADLINE_JOBS; j++) {
+		double start = wall_clock();
+		while(wall_clock() - start < 1E-3);
+		WaitPeriod();
+	}
+
+	deadline_info info;
+	GetDeadline(ThreadSelf(), &info);
+	return info.misses;
+}
+
+BOOT_TEST(test_deadline_misses,
+	"Run periodic threads of the deadline class next to a symposium of busy "
+	"philosophers, and report their deadline miss rate.",
+	.timeout = 120
+	)
+{
+	uint nper = 2*cpu_cores();
+
+	symposium_t symp;
+	symp.N = 2*cpu_cores()+1;
+	symp.bites = 5;
+	adjust_symposium(&symp, 0, 0);
+	ASSERT(Exec(SymposiumOfThreads, sizeof(symp), &symp)!=NOPROC);
+
+	Tid_t t[nper];
+	for(uint i=0; i<nper; i++)
+		t[i] = CreateThread(deadline_periodic_task, 0, NULL);
+
+	int misses = 0;
+	for(uint i=0; i<nper; i++) {
+		int m;
+		ASSERT(ThreadJoin(t[i], &m)==0);
+		ASSERT(m>=0);
+		misses += m;
+	}
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	double rate = (double)misses / (nper*DEADLINE_JOBS);
+	MSG("%u periodic threads, %d jobs, miss rate %.2f%%\n", nper, nper*DEADLINE_JOBS, 100*rate);
+
+	/* With fewer host cpus than cores, the host decides who runs */
+	if(sysconf(_SC_NPROCESSORS_ONLN) >= cpu_cores())
+		ASSERT_MSG(rate < 0.05, "Deadline miss rate %.2f%% is too high\n", 100*rate);
+	return 0;
+}
+
+#undef DEADLINE_JOBS
+
+
 BOOT_TEST(test_detach_self,
 	"Test that a thread can detach itself")
 {
@@ -1431,6 +1996,11 @@ TEST_SUITE(thread_tests,
 	&test_detach_main_thread,
 	&test_detach_after_join,
 	&test_create_join_thread,
+	&test_create_thread_stack,
+	&test_thread_priority,
+	&test_priority_raise_queued,
+	&test_deadline_admission,
+	&test_deadline_misses,
 	&test_join_many_threads,
 	&test_exit_many_threads,
 	&test_main_exit_cleanup,
@@ -1442,6 +2012,190 @@ TEST_SUITE(thread_tests,
 
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Reader-writer lock tests
+ *
+ *
+ *
+ *********************************************/
+
+
+struct rwlock_share {
+	RWLock* rw;
+	barrier* B;
+	unsigned int N;
+};
+
+static int rwlock_share_reader(int argl, void* args)
+{
+	struct rwlock_share* S = args;
+	RWLock_ReadLock(S->rw);
+	/* All readers must reach the barrier while holding the lock */
+	BarrierSync(S->B, S->N);
+	RWLock_Unlock(S->rw);
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_readers_share,
+	"Test that many threads can hold a reader-writer lock for reading at the same time, "
+	"and that a writer can lock it afterwards."
+	)
+{
+	const unsigned int N = 10;
+	RWLock rw = RWLOCK_INIT;
+	barrier B = BARRIER_INIT;
+	struct rwlock_share S = { &rw, &B, N };
+	Tid_t t[N];
+
+	for(unsigned int i=0; i<N; i++) {
+		t[i] = CreateThread(rwlock_share_reader, 0, &S);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+	for(unsigned int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	RWLock_WriteLock(&rw);
+	RWLock_Unlock(&rw);
+	return 0;
+}
+
+
+struct rwlock_mix {
+	RWLock* rw;
+	int a, b;               /* writers keep these equal */
+	int readers, writers;   /* the holders of the lock */
+	int errors;
+};
+
+static int rwlock_mix_task(int argl, void* args)
+{
+	struct rwlock_mix* M = args;
+	for(int i=0; i<2000; i++) {
+		if(i % 8 == argl % 8) {
+			RWLock_WriteLock(M->rw);
+			if(__atomic_add_fetch(&M->writers, 1, __ATOMIC_SEQ_CST)!=1
+					|| __atomic_load_n(&M->readers, __ATOMIC_SEQ_CST)!=0)
+				__atomic_add_fetch(&M->errors, 1, __ATOMIC_RELAXED);
+			M->a++;
+			fibo(5);
+			M->b++;
+			__atomic_sub_fetch(&M->writers, 1, __ATOMIC_SEQ_CST);
+			RWLock_Unlock(M->rw);
+		} else {
+			RWLock_ReadLock(M->rw);
+			__atomic_add_fetch(&M->readers, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&M->writers, __ATOMIC_SEQ_CST)!=0
+					|| __atomic_load_n(&M->a, __ATOMIC_RELAXED)!=__atomic_load_n(&M->b, __ATOMIC_RELAXED))
+				__atomic_add_fetch(&M->errors, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&M->readers, 1, __ATOMIC_SEQ_CST);
+			RWLock_Unlock(M->rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_writer_excludes,
+	"Test that a writer holding a reader-writer lock excludes all readers and "
+	"all other writers."
+	)
+{
+	const int N = 8;
+	RWLock rw = RWLOCK_INIT;
+	struct rwlock_mix M = { &rw, 0, 0, 0, 0, 0 };
+	Tid_t t[N];
+
+	for(int i=0; i<N; i++) {
+		t[i] = CreateThread(rwlock_mix_task, i, &M);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(M.errors==0);
+	ASSERT(M.a==M.b && M.a==N*2000/8);
+	return 0;
+}
+
+
+struct rwlock_order {
+	RWLock* rw;
+	unsigned int clock;     /* the order of entry */
+	unsigned int writer_ts, reader_ts;
+};
+
+static void rwlock_nap(timeout_t msec)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, msec);
+	Mutex_Unlock(&mx);
+}
+
+static int rwlock_order_writer(int argl, void* args)
+{
+	struct rwlock_order* O = args;
+	RWLock_WriteLock(O->rw);
+	O->writer_ts = __atomic_add_fetch(&O->clock, 1, __ATOMIC_SEQ_CST);
+	RWLock_Unlock(O->rw);
+	return 0;
+}
+
+static int rwlock_order_reader(int argl, void* args)
+{
+	struct rwlock_order* O = args;
+	RWLock_ReadLock(O->rw);
+	O->reader_ts = __atomic_add_fetch(&O->clock, 1, __ATOMIC_SEQ_CST);
+	RWLock_Unlock(O->rw);
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_writer_preference,
+	"Test that readers arriving while a writer waits for a reader-writer lock "
+	"wait for the writer, so that writers are not starved."
+	)
+{
+	RWLock rw = RWLOCK_INIT;
+	struct rwlock_order O = { &rw, 0, 0, 0 };
+
+	RWLock_ReadLock(&rw);
+
+	/* The writer waits for this thread to leave */
+	Tid_t w = CreateThread(rwlock_order_writer, 0, &O);
+	ASSERT(w!=NOTHREAD);
+	while(__atomic_load_n(&rw.writer, __ATOMIC_SEQ_CST)==0)
+		rwlock_nap(10);
+
+	/* A new reader must not overtake the writer */
+	Tid_t r = CreateThread(rwlock_order_reader, 0, &O);
+	ASSERT(r!=NOTHREAD);
+	sleep_thread(1);
+	ASSERT(O.writer_ts==0 && O.reader_ts==0);
+
+	RWLock_Unlock(&rw);
+	ASSERT(ThreadJoin(w, NULL)==0);
+	ASSERT(ThreadJoin(r, NULL)==0);
+	ASSERT(O.writer_ts < O.reader_ts);
+	return 0;
+}
+
+
+TEST_SUITE(rwlock_tests,
+	"A suite of tests for reader-writer locks."
+	)
+{
+	&test_rwlock_readers_share,
+	&test_rwlock_writer_excludes,
+	&test_rwlock_writer_preference,
+	NULL
+};
+
+
+
+
 
 
 
@@ -2592,6 +3346,7 @@ TEST_SUITE(all_tests,
 	//&concurrency_tests,
 	//&io_tests,
 	&thread_tests,
+	&rwlock_tests,
 	//&pipe_tests,
 	//&socket_tests,
 	NULL